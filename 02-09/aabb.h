@@ -15,6 +15,20 @@ public:
   Point3 min() const { return bounds[0]; }
   Point3 max() const { return bounds[1]; }
 
+  // A box containing nothing, the identity for surrounding_box
+  static Aabb empty() {
+    return Aabb(Point3(inf, inf, inf), Point3(-inf, -inf, -inf));
+  }
+
+  Point3 centroid() const { return 0.5 * (bounds[0] + bounds[1]); }
+
+  double surface_area() const {
+    auto d = bounds[1] - bounds[0];
+    if (d.x() < 0 || d.y() < 0 || d.z() < 0)
+      return 0;
+    return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+  }
+
   bool hit(const Ray &r, double tmin, double tmax) const {
     // taken from "An Efficient and Robust Ray-Box Intersection Algorithm"
     float txmin, txmax, tymin, tymax, tzmin, tzmax;
@@ -49,7 +63,7 @@ private:
   Point3 bounds[2];
 };
 
-inline Aabb surrounding_box(Aabb &box0, Aabb &box1) {
+inline Aabb surrounding_box(const Aabb &box0, const Aabb &box1) {
   Point3 small(std::min(box0.min().x(), box1.min().x()),
                fmin(box0.min().y(), box1.min().y()),
                fmin(box0.min().z(), box1.min().z()));
@@ -13,6 +13,8 @@ public:
 
   virtual bool hit(const Ray &r, double t_min, double t_max,
                    HitRecord &rec) const override;
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
 
   virtual bool bounding_box(double time0, double time1,
                             Aabb &output_box) const override {
@@ -52,6 +54,17 @@ inline bool xyRect::hit(const Ray &r, double t_min, double t_max,
   return true;
 }
 
+inline bool xyRect::occluded(const Ray &r, double t_min, double t_max) const {
+  auto t = (k - r.origin().z()) / r.direction().z();
+  if (t < t_min || t > t_max) {
+    return false;
+  }
+
+  auto x = r.origin().x() + t * r.direction().x();
+  auto y = r.origin().y() + t * r.direction().y();
+  return !(x < x0 || x > x1 || y < y0 || y > y1);
+}
+
 class xzRect : public Hittable {
 public:
   xzRect() {}
@@ -62,6 +75,8 @@ public:
 
   virtual bool hit(const Ray &r, double t_min, double t_max,
                    HitRecord &rec) const override;
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
 
   virtual bool bounding_box(double time0, double time1,
                             Aabb &output_box) const override {
@@ -101,6 +116,17 @@ inline bool xzRect::hit(const Ray &r, double t_min, double t_max,
   return true;
 }
 
+inline bool xzRect::occluded(const Ray &r, double t_min, double t_max) const {
+  auto t = (k - r.origin().y()) / r.direction().y();
+  if (t < t_min || t > t_max) {
+    return false;
+  }
+
+  auto x = r.origin().x() + t * r.direction().x();
+  auto z = r.origin().z() + t * r.direction().z();
+  return !(x < x0 || x > x1 || z < z0 || z > z1);
+}
+
 class yzRect : public Hittable {
 public:
   yzRect() {}
@@ -111,6 +137,8 @@ public:
 
   virtual bool hit(const Ray &r, double t_min, double t_max,
                    HitRecord &rec) const override;
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
 
   virtual bool bounding_box(double time0, double time1,
                             Aabb &output_box) const override {
@@ -149,3 +177,14 @@ inline bool yzRect::hit(const Ray &r, double t_min, double t_max,
   rec.p = r.at(t);
   return true;
 }
+
+inline bool yzRect::occluded(const Ray &r, double t_min, double t_max) const {
+  auto t = (k - r.origin().x()) / r.direction().x();
+  if (t < t_min || t > t_max) {
+    return false;
+  }
+
+  auto y = r.origin().y() + t * r.direction().y();
+  auto z = r.origin().z() + t * r.direction().z();
+  return !(y < y0 || y > y1 || z < z0 || z > z1);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh_build.h"
+#include "bvh_cache.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "kd_tree.h"
+#include "lazy_bvh.h"
+#include "linear_bvh.h"
+#include "motion_bvh.h"
+#include "quantized_bvh.h"
+#include "uniform_grid.h"
+#include "wide_bvh.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class Accelerator {
+  BvhTree,      // BvhNode, a tree of heap allocated nodes
+  BvhLinear,    // LinearBvh, one flat array of nodes
+  Bvh4,         // WideBvh<4>, four children per node tested with SSE
+  Bvh8,         // WideBvh<8>, eight children per node tested with AVX
+  BvhMotion,    // MotionBvh, bounds interpolated by ray time for motion blur
+  BvhQuantized, // QuantizedBvh, eight children with 8 bit boxes
+  Grid,         // UniformGrid, cells stepped through with a 3D DDA
+  KdTree,       // KdTree, SAH planes with primitives on both sides
+  BvhLazy       // LazyBvh, nodes split when a ray first reaches them
+};
+
+struct AcceleratorOptions {
+  Accelerator type = Accelerator::Bvh8;
+  BvhBuildOptions bvh;
+  std::string cache_dir;   // where builds are cached, empty disables the cache
+  double grid_density = 4; // Grid only: cells per primitive
+};
+
+// Whether type stores a BvhBuild made up front, rather than building its
+// own structure over the objects
+inline bool uses_bvh_build(Accelerator type) {
+  return type != Accelerator::Grid && type != Accelerator::KdTree &&
+         type != Accelerator::BvhLazy;
+}
+
+// Stores a finished build in the layout chosen by options.type. time0 and
+// time1 are the shutter interval the build was made for. Types that do not
+// use a BvhBuild are built over objects with options, ignoring build.
+inline std::shared_ptr<Hittable>
+make_accelerator(const BvhBuild &build,
+                 const std::vector<std::shared_ptr<Hittable>> &objects,
+                 double time0, double time1,
+                 const AcceleratorOptions &options) {
+  switch (options.type) {
+  case Accelerator::BvhTree:
+    return std::make_shared<BvhNode>(build, objects);
+  case Accelerator::Bvh4:
+    return std::make_shared<Bvh4>(build, objects);
+  case Accelerator::Bvh8:
+    return std::make_shared<Bvh8>(build, objects);
+  case Accelerator::BvhMotion:
+    return std::make_shared<MotionBvh>(build, objects, time0, time1);
+  case Accelerator::BvhQuantized:
+    return std::make_shared<QuantizedBvh>(build, objects);
+  case Accelerator::Grid:
+    return std::make_shared<UniformGrid>(objects, time0, time1,
+                                         options.grid_density);
+  case Accelerator::KdTree:
+    return std::make_shared<KdTree>(objects, time0, time1, options.bvh);
+  case Accelerator::BvhLazy:
+    return std::make_shared<LazyBvh>(objects, time0, time1, options.bvh);
+  case Accelerator::BvhLinear:
+    break;
+  }
+  return std::make_shared<LinearBvh>(build, objects);
+}
+
+// Builds the acceleration structure chosen by options over list, or loads the
+// BVH build from options.cache_dir
+inline std::shared_ptr<Hittable>
+make_accelerator(const HittableList &list, double time0, double time1,
+                 const AcceleratorOptions &options) {
+  if (options.type == Accelerator::Grid) {
+    return std::make_shared<UniformGrid>(list, time0, time1,
+                                         options.grid_density);
+  }
+  if (options.type == Accelerator::KdTree)
+    return std::make_shared<KdTree>(list, time0, time1, options.bvh);
+  if (options.type == Accelerator::BvhLazy)
+    return std::make_shared<LazyBvh>(list, time0, time1, options.bvh);
+
+  auto build = cached_bvh_build(bvh_primitives(list.objects, time0, time1),
+                                options.bvh, options.cache_dir);
+  return make_accelerator(build, list.objects, time0, time1, options);
+}
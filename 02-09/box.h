@@ -18,6 +18,11 @@ public:
   virtual bool hit(const Ray &r, double t_min, double t_max,
                    HitRecord &rec) const override;
 
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override {
+    return sides.occluded(r, t_min, t_max);
+  }
+
   virtual bool bounding_box(double time0, double time1,
                             Aabb &output_box) const override {
     output_box = Aabb(box_min, box_max);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "bvh_build.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "rtweekend.h"
@@ -32,7 +33,7 @@ inline bool box_z_compare(const std::shared_ptr<Hittable> a,
 
 class BvhNode : public Hittable {
 public:
-  BvhNode();
+  BvhNode() {}
 
   BvhNode(const HittableList &list, double time0, double time1)
       : BvhNode(list.objects, 0, list.objects.size(), time0, time1) {}
@@ -40,16 +41,44 @@ public:
   BvhNode(const std::vector<std::shared_ptr<Hittable>> &src_objects,
           std::size_t start, std::size_t end, double time0, double time1);
 
+  // Builds the hierarchy with BvhBuilder, leaves with several primitives
+  // become a HittableList child
+  BvhNode(const HittableList &list, double time0, double time1,
+          const BvhBuildOptions &options)
+      : BvhNode(BvhBuilder(options).build(
+                    bvh_primitives(list.objects, time0, time1)),
+                list.objects) {}
+
+  BvhNode(const BvhBuild &build,
+          const std::vector<std::shared_ptr<Hittable>> &objects)
+      : BvhNode(build, 0, objects) {}
+
   virtual bool hit(const Ray &r, double t_min, double t_max,
                    HitRecord &rec) const override;
 
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
+
   virtual bool bounding_box(double time0, double time1,
                             Aabb &output_box) const override;
 
   virtual ~BvhNode() = default;
 
 private:
+  // The original builder, sorts objects[start, end) in place
+  void build_median(std::vector<std::shared_ptr<Hittable>> &objects,
+                    std::size_t start, std::size_t end, double time0,
+                    double time1);
+
+  BvhNode(const BvhBuild &build, std::uint32_t node,
+          const std::vector<std::shared_ptr<Hittable>> &objects);
+
+  static std::shared_ptr<Hittable>
+  make_child(const BvhBuild &build, std::uint32_t node,
+             const std::vector<std::shared_ptr<Hittable>> &objects);
+
   std::shared_ptr<Hittable> left;
+  // Only null when the whole hierarchy is a single leaf
   std::shared_ptr<Hittable> right;
   Aabb box;
 };
@@ -60,11 +89,20 @@ inline bool BvhNode::hit(const Ray &r, double t_min, double t_max,
     return false;
 
   bool hit_left = left->hit(r, t_min, t_max, rec);
-  bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+  bool hit_right =
+      right && right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
 
   return hit_left || hit_right;
 }
 
+inline bool BvhNode::occluded(const Ray &r, double t_min,
+                              double t_max) const {
+  if (!box.hit(r, t_min, t_max))
+    return false;
+  return left->occluded(r, t_min, t_max) ||
+         (right && right->occluded(r, t_min, t_max));
+}
+
 inline bool BvhNode::bounding_box(double time0, double time1,
                                   Aabb &output_box) const {
   output_box = box;
@@ -74,8 +112,15 @@ inline bool BvhNode::bounding_box(double time0, double time1,
 inline BvhNode::BvhNode(
     const std::vector<std::shared_ptr<Hittable>> &src_objects,
     std::size_t start, std::size_t end, double time0, double time1) {
-  auto objects = src_objects; // A modifiable array of the source scene objects
+  // One modifiable copy of the source scene objects for the whole build
+  auto objects = src_objects;
+  build_median(objects, start, end, time0, time1);
+}
 
+inline void
+BvhNode::build_median(std::vector<std::shared_ptr<Hittable>> &objects,
+                      std::size_t start, std::size_t end, double time0,
+                      double time1) {
   int axis = random_int(0, 3);
   auto comparator = (axis == 0)   ? box_x_compare
                     : (axis == 1) ? box_y_compare
@@ -97,8 +142,12 @@ inline BvhNode::BvhNode(
     std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
     auto mid = start + object_span / 2;
-    left = std::make_shared<BvhNode>(objects, start, mid, time0, time1);
-    right = std::make_shared<BvhNode>(objects, mid, end, time0, time1);
+    auto left_node = std::make_shared<BvhNode>();
+    left_node->build_median(objects, start, mid, time0, time1);
+    auto right_node = std::make_shared<BvhNode>();
+    right_node->build_median(objects, mid, end, time0, time1);
+    left = left_node;
+    right = right_node;
   }
 
   Aabb box_left, box_right;
@@ -110,3 +159,34 @@ inline BvhNode::BvhNode(
 
   box = surrounding_box(box_left, box_right);
 }
+
+inline BvhNode::BvhNode(
+    const BvhBuild &build, std::uint32_t node,
+    const std::vector<std::shared_ptr<Hittable>> &objects)
+    : box(build.nodes[node].bounds) {
+  const auto &n = build.nodes[node];
+  if (n.leaf()) {
+    left = make_child(build, node, objects);
+  } else {
+    left = make_child(build, n.child[0], objects);
+    right = make_child(build, n.child[1], objects);
+  }
+}
+
+inline std::shared_ptr<Hittable>
+BvhNode::make_child(const BvhBuild &build, std::uint32_t node,
+                    const std::vector<std::shared_ptr<Hittable>> &objects) {
+  const auto &n = build.nodes[node];
+  if (!n.leaf()) {
+    return std::shared_ptr<BvhNode>(new BvhNode(build, node, objects));
+  }
+  if (n.count == 1) {
+    return objects[build.prims[n.first].index];
+  }
+
+  auto leaf = std::make_shared<HittableList>();
+  for (auto i = n.first; i < n.first + n.count; i++) {
+    leaf->add(objects[build.prims[i].index]);
+  }
+  return leaf;
+}
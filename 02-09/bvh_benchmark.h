@@ -0,0 +1,240 @@
+#pragma once
+
+#include "accelerator.h"
+#include "bvh.h"
+#include "bvh_build.h"
+#include "dynamic_bvh.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "lazy_bvh.h"
+#include "ray.h"
+#include "sampler.h"
+#include "transform.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+struct BvhBenchmark {
+  double build_ms;
+  double sah_cost; // 0 for grids and kd-trees
+  double ns_per_ray;
+  double hit_fraction;
+  double ns_per_occluded; // occluded() on the same rays
+};
+
+struct LazyBenchmark {
+  double eager_first_ms; // full build of options.type plus the first ray
+  double lazy_first_ms;  // LazyBvh set up plus the first ray
+  double eager_ns_per_ray;
+  double lazy_ns_per_ray; // including the nodes split on the way
+  std::size_t eager_nodes;
+  std::size_t lazy_nodes; // split by the time every ray is traced
+};
+
+struct RefitBenchmark {
+  double update_ms;  // DynamicBvh::update, refit or rebuild
+  double rebuild_ms; // a full build of the same frame
+  double sah_cost;
+  bool rebuilt;
+};
+
+/**
+ * Rays for comparing hierarchies over the same objects: each starts on a
+ * sphere around the bounds and aims at a random point inside them. They are
+ * the same for every run.
+ */
+inline std::vector<Ray> benchmark_rays(const Aabb &bounds, std::size_t count,
+                                       double time0, double time1) {
+  std::vector<Ray> rays;
+  rays.reserve(count);
+  const auto center = bounds.centroid();
+  const auto extent = bounds.max() - bounds.min();
+  const auto radius = extent.length();
+
+  for (std::size_t i = 0; i < count; i++) {
+    Sampler sampler(i, 0);
+    auto origin = center + radius * random_unit_vector(sampler);
+    auto target = bounds.min() + Vec3(extent.x() * sampler.random_double(),
+                                      extent.y() * sampler.random_double(),
+                                      extent.z() * sampler.random_double());
+    rays.emplace_back(origin, target - origin,
+                      sampler.random_double(time0, time1));
+  }
+  return rays;
+}
+
+// Builds the accelerator over objects and times closest hit and occlusion
+// queries against it
+inline BvhBenchmark benchmark_bvh(const HittableList &objects,
+                                  const AcceleratorOptions &options,
+                                  const std::vector<Ray> &rays, double time0,
+                                  double time1) {
+  using clock = std::chrono::high_resolution_clock;
+  BvhBenchmark result;
+
+  auto start = clock::now();
+  std::shared_ptr<Hittable> bvh;
+  result.sah_cost = 0;
+  if (uses_bvh_build(options.type)) {
+    auto build = BvhBuilder(options.bvh).build(
+        bvh_primitives(objects.objects, time0, time1));
+    bvh = make_accelerator(build, objects.objects, time0, time1, options);
+    result.sah_cost = build.sah_cost(options.bvh);
+  } else {
+    bvh = make_accelerator(objects, time0, time1, options);
+  }
+  std::chrono::duration<double, std::milli> build_time = clock::now() - start;
+  result.build_ms = build_time.count();
+
+  std::size_t hits = 0;
+  HitRecord rec;
+  start = clock::now();
+  for (const auto &ray : rays) {
+    hits += bvh->hit(ray, 0.001, inf, rec);
+  }
+  std::chrono::duration<double, std::nano> trace = clock::now() - start;
+  result.ns_per_ray = trace.count() / rays.size();
+  result.hit_fraction = static_cast<double>(hits) / rays.size();
+
+  std::size_t occluded = 0;
+  start = clock::now();
+  for (const auto &ray : rays) {
+    occluded += bvh->occluded(ray, 0.001, inf);
+  }
+  trace = clock::now() - start;
+  result.ns_per_occluded = trace.count() / rays.size();
+  if (occluded != hits) {
+    std::cerr << "ERROR: " << occluded << " rays occluded but " << hits
+              << " hit.\n";
+  }
+  return result;
+}
+
+/**
+ * Benchmarks every accelerator in types over objects, with the rest of
+ * options as given, and returns the one answering closest hit queries for
+ * rays fastest. results, when given, receives the benchmark of each type.
+ * Run it on a subtree's objects to choose the accelerator for that subtree.
+ */
+inline Accelerator
+fastest_accelerator(const HittableList &objects, AcceleratorOptions options,
+                    const std::vector<Accelerator> &types,
+                    const std::vector<Ray> &rays, double time0, double time1,
+                    std::vector<BvhBenchmark> *results = nullptr) {
+  auto fastest = options.type;
+  auto best = inf;
+  for (auto type : types) {
+    options.type = type;
+    auto result = benchmark_bvh(objects, options, rays, time0, time1);
+    if (result.ns_per_ray < best) {
+      best = result.ns_per_ray;
+      fastest = type;
+    }
+    if (results)
+      results->push_back(result);
+  }
+  return fastest;
+}
+
+/**
+ * Times a LazyBvh over objects against a full build in the layout chosen by
+ * options: how long until the first ray is answered, how long the rest
+ * take, and how many nodes either has once every ray is traced. Rays that
+ * only reach part of the scene, like a crop, show what a lazy build saves.
+ */
+inline LazyBenchmark benchmark_lazy(const HittableList &objects,
+                                    const AcceleratorOptions &options,
+                                    const std::vector<Ray> &rays, double time0,
+                                    double time1) {
+  using clock = std::chrono::high_resolution_clock;
+  LazyBenchmark result{};
+  HitRecord rec;
+  if (rays.empty())
+    return result;
+
+  auto start = clock::now();
+  auto build = BvhBuilder(options.bvh).build(
+      bvh_primitives(objects.objects, time0, time1));
+  auto eager = make_accelerator(build, objects.objects, time0, time1, options);
+  eager->hit(rays[0], 0.001, inf, rec);
+  std::chrono::duration<double, std::milli> first = clock::now() - start;
+  result.eager_first_ms = first.count();
+  result.eager_nodes = build.nodes.size();
+
+  start = clock::now();
+  LazyBvh lazy(objects, time0, time1, options.bvh);
+  lazy.hit(rays[0], 0.001, inf, rec);
+  first = clock::now() - start;
+  result.lazy_first_ms = first.count();
+
+  // The first ray is in the times above, the rest are timed per ray
+  const auto traced = std::max<std::size_t>(rays.size() - 1, 1);
+  start = clock::now();
+  for (std::size_t i = 1; i < rays.size(); i++) {
+    eager->hit(rays[i], 0.001, inf, rec);
+  }
+  std::chrono::duration<double, std::nano> trace = clock::now() - start;
+  result.eager_ns_per_ray = trace.count() / traced;
+
+  start = clock::now();
+  for (std::size_t i = 1; i < rays.size(); i++) {
+    lazy.hit(rays[i], 0.001, inf, rec);
+  }
+  trace = clock::now() - start;
+  result.lazy_ns_per_ray = trace.count() / traced;
+  result.lazy_nodes = lazy.node_count();
+  return result;
+}
+
+/**
+ * Animates objects over frames: every frame each object moves with
+ * probability moved_fraction by up to distance along every axis, placed as a
+ * translated Instance of the original. Times DynamicBvh::update against a
+ * full build of the same frame. The motion is the same for every run.
+ */
+inline std::vector<RefitBenchmark>
+benchmark_refit(const HittableList &objects, const AcceleratorOptions &options,
+                int frames, double moved_fraction, double distance,
+                double time0, double time1) {
+  using clock = std::chrono::high_resolution_clock;
+  std::vector<RefitBenchmark> results;
+
+  auto frame = objects;
+  std::vector<Vec3> offsets(objects.objects.size());
+  DynamicBvh bvh(frame, time0, time1, options);
+
+  for (int f = 1; f <= frames; f++) {
+    for (std::size_t i = 0; i < offsets.size(); i++) {
+      Sampler sampler(i, f);
+      if (sampler.random_double() >= moved_fraction)
+        continue;
+      offsets[i] += Vec3(sampler.random_double(-distance, distance),
+                         sampler.random_double(-distance, distance),
+                         sampler.random_double(-distance, distance));
+      frame.objects[i] = std::make_shared<Instance>(
+          objects.objects[i], Transform::translate(offsets[i]));
+    }
+
+    RefitBenchmark result;
+    auto start = clock::now();
+    result.rebuilt = bvh.update(frame, time0, time1);
+    std::chrono::duration<double, std::milli> update_time =
+        clock::now() - start;
+    result.update_ms = update_time.count();
+    result.sah_cost = bvh.sah_cost();
+
+    start = clock::now();
+    auto build = BvhBuilder(options.bvh).build(
+        bvh_primitives(frame.objects, time0, time1));
+    make_accelerator(build, frame.objects, time0, time1, options);
+    std::chrono::duration<double, std::milli> rebuild_time =
+        clock::now() - start;
+    result.rebuild_ms = rebuild_time.count();
+    results.push_back(result);
+  }
+  return results;
+}
@@ -0,0 +1,780 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "rtweekend.h"
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_sort.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+
+enum class BvhSplit {
+  Median, // random axis, split at the median (the original BvhNode builder)
+  Sah,    // binned surface area heuristic over primitive centroids
+  Lbvh,   // split on the bits of sorted Morton codes, fast for previews
+  Sbvh    // Sah plus spatial splits that reference primitives on both sides
+};
+
+struct BvhBuildOptions {
+  BvhSplit split = BvhSplit::Sah;
+  int max_leaf_size = 4; // primitives per leaf
+  int bins = 16;         // candidate split planes per axis are bins - 1
+  // Cost of visiting a node relative to one primitive test
+  double traversal_cost = 1.0;
+  double intersection_cost = 1.0;
+  // Sbvh only: spatial splits may add up to this fraction of the primitive
+  // count as extra references, and are only tried in nodes whose object
+  // split children overlap by more than this fraction of the root's area
+  double max_duplication = 0.5;
+  double spatial_split_overlap = 1e-5;
+};
+
+// What the builder needs to know about each primitive
+struct BvhPrimitive {
+  Aabb bounds;
+  Point3 centroid;
+  std::size_t index; // into the source objects
+};
+
+// Trees never get deeper than this, so traversal stacks can be fixed size
+const int max_bvh_depth = 64;
+
+// A node of a built hierarchy. Leaves reference prims[first, first + count),
+// interior nodes (count == 0) reference two other nodes.
+struct BvhBuildNode {
+  Aabb bounds;
+  std::uint32_t child[2];
+  std::uint32_t first;
+  std::uint32_t count;
+  int axis;
+
+  bool leaf() const { return count > 0; }
+};
+
+/**
+ * A hierarchy built over a set of objects, independent of how it is later
+ * stored for traversal. nodes[0] is the root and prims lists the primitives
+ * in leaf order.
+ */
+struct BvhBuild {
+  std::vector<BvhBuildNode> nodes;
+  std::vector<BvhPrimitive> prims;
+
+  // Expected cost of a random ray hitting the root, in primitive tests
+  double sah_cost(const BvhBuildOptions &options) const;
+
+  // Recomputes every box bottom up from where objects are now, keeping the
+  // tree as it is. objects must be the list the build was made from, in the
+  // same order, though any of them may have moved or been replaced.
+  void refit(const std::vector<std::shared_ptr<Hittable>> &objects,
+             double time0, double time1);
+};
+
+inline std::vector<BvhPrimitive>
+bvh_primitives(const std::vector<std::shared_ptr<Hittable>> &objects,
+               double time0, double time1) {
+  std::vector<BvhPrimitive> prims(objects.size());
+  tbb::parallel_for(std::size_t(0), objects.size(), [&](std::size_t i) {
+    Aabb box;
+    if (!objects[i]->bounding_box(time0, time1, box)) {
+      std::cerr << "No bounding box in BvhNode constructor." << std::endl;
+    }
+    prims[i] = {box, box.centroid(), i};
+  });
+  return prims;
+}
+
+/**
+ * Top down builder that partitions primitives in place by their centroids.
+ *
+ * With BvhSplit::Sah every axis is divided into options.bins equal bins over
+ * the centroid bounds, and the plane between two bins with the lowest
+ * surface area heuristic cost is chosen. A range becomes a leaf when it fits
+ * in max_leaf_size and testing its primitives is cheaper than splitting.
+ *
+ * With BvhSplit::Lbvh the primitives are sorted once by the Morton code of
+ * their centroids and every range is split where the highest bit that
+ * differs inside it changes. Ranges that fit in max_leaf_size become leaves.
+ *
+ * BvhSplit::Sbvh also bins every axis spatially over the node bounds, where
+ * a primitive counts in every bin it overlaps, clipped to the bin. When that
+ * split is cheaper the primitives straddling its plane are referenced from
+ * both sides with their boxes clipped, so large primitives overlapping many
+ * small ones no longer make every node around them big. Primitives are not
+ * clipped exactly, only their boxes, which keeps them as generic Hittables.
+ * Spatial splits stop once options.max_duplication extra references have
+ * been made. The spatial builder runs on one thread.
+ *
+ * Large ranges are bounded and binned with TBB, and the two halves of a
+ * split are built as parallel tasks. A subtree over m primitives has at most
+ * 2m - 1 nodes, so each task writes to its own slice of a preallocated
+ * array, and the nodes are compacted in depth first order afterwards. The
+ * result is the same whatever the number of threads. The median builder
+ * draws random axes from the shared generator and stays on one thread.
+ */
+class BvhBuilder {
+public:
+  BvhBuilder(const BvhBuildOptions &options) : options(options) {}
+
+  BvhBuild build(std::vector<BvhPrimitive> prims) const;
+
+  // Decides how the node over prims[start, end) at depth splits, for
+  // builders that make one node at a time. Partitions the range and returns
+  // where the second child starts with axis set to the split axis, or end
+  // when the node stays a leaf. codes are the Morton codes of an Lbvh
+  // build, and may be empty for the other builders.
+  std::size_t split_range(std::vector<BvhPrimitive> &prims,
+                          const std::vector<std::uint32_t> &codes,
+                          std::size_t start, std::size_t end,
+                          const Aabb &bounds, const Aabb &centroid_bounds,
+                          int depth, int &axis) const;
+
+  // Bounds of prims[start, end) and of their centroids
+  static void range_bounds(const std::vector<BvhPrimitive> &prims,
+                           std::size_t start, std::size_t end, Aabb &bounds,
+                           Aabb &centroid_bounds);
+
+private:
+  struct Split {
+    int axis = -1;
+    std::size_t mid = 0;
+    double cost = inf;
+  };
+
+  struct Bin {
+    Aabb bounds = Aabb::empty();
+    std::size_t count = 0;
+  };
+
+  struct SpatialSplit {
+    int axis = -1;
+    double position = 0;
+    double cost = inf;
+  };
+
+  // Ranges at least this large are split in parallel
+  static const std::size_t parallel_split = 4096;
+  // Ranges at least this large are bounded and binned in parallel
+  static const std::size_t parallel_scan = 65536;
+
+  void build_range(std::vector<BvhBuildNode> &nodes,
+                   std::vector<BvhPrimitive> &prims,
+                   const std::vector<std::uint32_t> &codes, std::size_t start,
+                   std::size_t end, int depth, std::uint32_t slot) const;
+  Split find_split(std::vector<BvhPrimitive> &prims,
+                   const std::vector<std::uint32_t> &codes, std::size_t start,
+                   std::size_t end, const Aabb &bounds,
+                   const Aabb &centroid_bounds) const;
+  Split find_sah_split(std::vector<BvhPrimitive> &prims, std::size_t start,
+                       std::size_t end, const Aabb &bounds,
+                       const Aabb &centroid_bounds) const;
+  static Split find_morton_split(const std::vector<std::uint32_t> &codes,
+                                 std::size_t start, std::size_t end);
+  static std::vector<std::uint32_t>
+  sort_by_morton_code(std::vector<BvhPrimitive> &prims);
+
+  BvhBuild build_spatial(std::vector<BvhPrimitive> prims) const;
+  // Appends the node over refs and its subtree to out, depth first
+  void build_spatial_node(BvhBuild &out, std::vector<BvhPrimitive> refs,
+                          int depth, double root_area,
+                          std::size_t &spare) const;
+  SpatialSplit find_spatial_split(const std::vector<BvhPrimitive> &refs,
+                                  const Aabb &bounds) const;
+  static void compact(const std::vector<BvhBuildNode> &sparse,
+                      std::uint32_t node, std::vector<BvhBuildNode> &out);
+
+  BvhBuildOptions options;
+};
+
+// Spreads the low 10 bits of v so there are two zero bits between each
+inline std::uint32_t expand_bits(std::uint32_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// 30 bit Morton code of a point with coordinates in [0, 1], x in the highest
+// bit of each triple
+inline std::uint32_t morton_code(const Point3 &p) {
+  auto quantize = [](double x) {
+    return static_cast<std::uint32_t>(std::min(std::max(x * 1024, 0.0), 1023.0));
+  };
+  return (expand_bits(quantize(p.x())) << 2) |
+         (expand_bits(quantize(p.y())) << 1) | expand_bits(quantize(p.z()));
+}
+
+// b with its extent along axis limited to [lo, hi]
+inline Aabb clip_box(const Aabb &b, int axis, double lo, double hi) {
+  auto min = b.min();
+  auto max = b.max();
+  min[axis] = std::max(min[axis], lo);
+  max[axis] = std::min(max[axis], hi);
+  return Aabb(min, max);
+}
+
+inline BvhBuild BvhBuilder::build(std::vector<BvhPrimitive> prims) const {
+  if (options.split == BvhSplit::Sbvh)
+    return build_spatial(std::move(prims));
+
+  BvhBuild result;
+  result.prims = std::move(prims);
+  if (result.prims.empty())
+    return result;
+
+  std::vector<std::uint32_t> codes;
+  if (options.split == BvhSplit::Lbvh) {
+    codes = sort_by_morton_code(result.prims);
+  }
+
+  std::vector<BvhBuildNode> sparse(2 * result.prims.size() - 1);
+  build_range(sparse, result.prims, codes, 0, result.prims.size(), 0, 0);
+
+  result.nodes.reserve(2 * result.prims.size() - 1);
+  compact(sparse, 0, result.nodes);
+  return result;
+}
+
+inline void BvhBuilder::build_range(std::vector<BvhBuildNode> &nodes,
+                                    std::vector<BvhPrimitive> &prims,
+                                    const std::vector<std::uint32_t> &codes,
+                                    std::size_t start, std::size_t end,
+                                    int depth, std::uint32_t slot) const {
+  Aabb bounds, centroid_bounds;
+  range_bounds(prims, start, end, bounds, centroid_bounds);
+
+  const auto count = end - start;
+  auto &node = nodes[slot];
+  node = {bounds, {0, 0}, static_cast<std::uint32_t>(start),
+          static_cast<std::uint32_t>(count), 0};
+  int axis = 0;
+  const auto mid = split_range(prims, codes, start, end, bounds,
+                               centroid_bounds, depth, axis);
+  if (mid == end)
+    return;
+
+  // The left subtree takes the 2 * (mid - start) - 1 slots after this one,
+  // the right subtree the ones after that
+  const auto left = slot + 1;
+  const auto right = static_cast<std::uint32_t>(slot + 2 * (mid - start));
+  node.child[0] = left;
+  node.child[1] = right;
+  node.count = 0;
+  node.axis = axis;
+
+  auto build_left = [&] {
+    build_range(nodes, prims, codes, start, mid, depth + 1, left);
+  };
+  auto build_right = [&] {
+    build_range(nodes, prims, codes, mid, end, depth + 1, right);
+  };
+  if (count >= parallel_split && options.split != BvhSplit::Median) {
+    tbb::parallel_invoke(build_left, build_right);
+  } else {
+    build_left();
+    build_right();
+  }
+}
+
+inline std::size_t BvhBuilder::split_range(
+    std::vector<BvhPrimitive> &prims, const std::vector<std::uint32_t> &codes,
+    std::size_t start, std::size_t end, const Aabb &bounds,
+    const Aabb &centroid_bounds, int depth, int &axis) const {
+  const auto count = end - start;
+  if (count == 1)
+    return end;
+
+  Split split;
+  if (depth < max_bvh_depth / 2) {
+    split = find_split(prims, codes, start, end, bounds, centroid_bounds);
+  } else {
+    // Very unbalanced so far. Halving the range from here on keeps the tree
+    // within max_bvh_depth for up to 2^32 primitives.
+    split.axis = -1;
+  }
+  const auto leaf_cost = options.intersection_cost * count;
+  if (count <= static_cast<std::size_t>(options.max_leaf_size) &&
+      (split.axis < 0 || leaf_cost <= split.cost)) {
+    return end;
+  }
+
+  if (split.axis < 0) {
+    // All centroids coincide (or the tree is too deep), split in half
+    split.axis = 0;
+    split.mid = start + count / 2;
+  }
+  axis = split.axis;
+  return split.mid;
+}
+
+inline void BvhBuilder::range_bounds(const std::vector<BvhPrimitive> &prims,
+                                     std::size_t start, std::size_t end,
+                                     Aabb &bounds, Aabb &centroid_bounds) {
+  using Bounds = std::pair<Aabb, Aabb>;
+  auto grow = [&](const tbb::blocked_range<std::size_t> &range, Bounds b) {
+    for (auto i = range.begin(); i < range.end(); i++) {
+      b.first = surrounding_box(b.first, prims[i].bounds);
+      b.second = surrounding_box(b.second,
+                                 Aabb(prims[i].centroid, prims[i].centroid));
+    }
+    return b;
+  };
+  const Bounds empty(Aabb::empty(), Aabb::empty());
+  const tbb::blocked_range<std::size_t> range(start, end);
+
+  Bounds result;
+  if (end - start >= parallel_scan) {
+    result = tbb::parallel_reduce(
+        range, empty, grow, [](const Bounds &a, const Bounds &b) {
+          return Bounds(surrounding_box(a.first, b.first),
+                        surrounding_box(a.second, b.second));
+        });
+  } else {
+    result = grow(range, empty);
+  }
+  bounds = result.first;
+  centroid_bounds = result.second;
+}
+
+inline BvhBuilder::Split
+BvhBuilder::find_split(std::vector<BvhPrimitive> &prims,
+                       const std::vector<std::uint32_t> &codes,
+                       std::size_t start, std::size_t end, const Aabb &bounds,
+                       const Aabb &centroid_bounds) const {
+  switch (options.split) {
+  case BvhSplit::Median: {
+    Split best;
+    best.axis = random_int(0, 3);
+    best.mid = start + (end - start) / 2;
+    std::nth_element(prims.begin() + start, prims.begin() + best.mid,
+                     prims.begin() + end,
+                     [&](const BvhPrimitive &a, const BvhPrimitive &b) {
+                       return a.bounds.min()[best.axis] <
+                              b.bounds.min()[best.axis];
+                     });
+    best.cost = 0;
+    return best;
+  }
+  case BvhSplit::Lbvh:
+    return find_morton_split(codes, start, end);
+  case BvhSplit::Sah:
+  case BvhSplit::Sbvh:
+    break;
+  }
+  return find_sah_split(prims, start, end, bounds, centroid_bounds);
+}
+
+inline BvhBuilder::Split
+BvhBuilder::find_sah_split(std::vector<BvhPrimitive> &prims, std::size_t start,
+                           std::size_t end, const Aabb &bounds,
+                           const Aabb &centroid_bounds) const {
+  Split best;
+  const int bins = std::max(2, options.bins);
+  const auto area = std::max(bounds.surface_area(), 1e-300);
+  const auto lo = centroid_bounds.min();
+  const auto extent = centroid_bounds.max() - lo;
+
+  // The bin of p along axis. Binning and the partition below share it, so
+  // they agree on the side of the chosen plane every primitive is on.
+  double scale[3];
+  for (int axis = 0; axis < 3; axis++) {
+    scale[axis] = extent[axis] > 0 ? bins / extent[axis] : 0;
+  }
+  auto bin_of = [&](const BvhPrimitive &p, int axis) {
+    auto k = static_cast<int>((p.centroid[axis] - lo[axis]) * scale[axis]);
+    return std::min(std::max(k, 0), bins - 1);
+  };
+
+  // Bin every axis in one pass over the primitives
+  using Bins = std::array<std::vector<Bin>, 3>;
+  const Bins empty = {std::vector<Bin>(bins), std::vector<Bin>(bins),
+                      std::vector<Bin>(bins)};
+  auto fill = [&](const tbb::blocked_range<std::size_t> &range, Bins b) {
+    for (auto i = range.begin(); i < range.end(); i++) {
+      for (int axis = 0; axis < 3; axis++) {
+        if (!(extent[axis] > 0))
+          continue;
+        const auto k = bin_of(prims[i], axis);
+        b[axis][k].count++;
+        b[axis][k].bounds = surrounding_box(b[axis][k].bounds, prims[i].bounds);
+      }
+    }
+    return b;
+  };
+  const tbb::blocked_range<std::size_t> range(start, end);
+  Bins bin;
+  if (end - start >= parallel_scan) {
+    bin = tbb::parallel_reduce(range, empty, fill, [&](Bins a, const Bins &b) {
+      for (int axis = 0; axis < 3; axis++) {
+        for (int k = 0; k < bins; k++) {
+          a[axis][k].count += b[axis][k].count;
+          a[axis][k].bounds =
+              surrounding_box(a[axis][k].bounds, b[axis][k].bounds);
+        }
+      }
+      return a;
+    });
+  } else {
+    bin = fill(range, empty);
+  }
+
+  std::vector<double> right_area(bins);
+  std::vector<std::size_t> right_count(bins);
+  int best_bin = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    if (!(extent[axis] > 0))
+      continue;
+
+    // Sweep from the right, then from the left evaluating each plane
+    auto box = Aabb::empty();
+    std::size_t n = 0;
+    for (int b = bins - 1; b > 0; b--) {
+      box = surrounding_box(box, bin[axis][b].bounds);
+      n += bin[axis][b].count;
+      right_area[b] = box.surface_area();
+      right_count[b] = n;
+    }
+
+    box = Aabb::empty();
+    n = 0;
+    for (int b = 0; b < bins - 1; b++) {
+      box = surrounding_box(box, bin[axis][b].bounds);
+      n += bin[axis][b].count;
+      if (n == 0 || right_count[b + 1] == 0)
+        continue;
+      auto cost = options.traversal_cost +
+                  options.intersection_cost *
+                      (box.surface_area() * n +
+                       right_area[b + 1] * right_count[b + 1]) /
+                      area;
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best_bin = b;
+      }
+    }
+  }
+
+  if (best.axis < 0)
+    return best;
+
+  const auto axis = best.axis;
+  auto middle = std::partition(
+      prims.begin() + start, prims.begin() + end,
+      [&](const BvhPrimitive &p) { return bin_of(p, axis) <= best_bin; });
+  best.mid = middle - prims.begin();
+  return best;
+}
+
+inline BvhBuilder::Split
+BvhBuilder::find_morton_split(const std::vector<std::uint32_t> &codes,
+                              std::size_t start, std::size_t end) {
+  Split best;
+  const auto first = codes[start];
+  const auto last = codes[end - 1];
+  if (first == last)
+    return best;
+
+  // Highest bit that differs in the range, the codes are sorted so the
+  // range splits where it changes from 0 to 1
+  int bit = 31;
+  while (!((first ^ last) & (1u << bit)))
+    bit--;
+  const auto mask = 1u << bit;
+  best.mid = std::partition_point(codes.begin() + start, codes.begin() + end,
+                                  [&](std::uint32_t code) {
+                                    return !(code & mask);
+                                  }) -
+             codes.begin();
+  best.axis = 2 - bit % 3;
+  // Never cheaper than a leaf, ranges that fit become leaves
+  best.cost = inf;
+  return best;
+}
+
+inline std::vector<std::uint32_t>
+BvhBuilder::sort_by_morton_code(std::vector<BvhPrimitive> &prims) {
+  Aabb bounds, centroid_bounds;
+  range_bounds(prims, 0, prims.size(), bounds, centroid_bounds);
+  const auto lo = centroid_bounds.min();
+  auto extent = centroid_bounds.max() - lo;
+  for (int axis = 0; axis < 3; axis++) {
+    if (!(extent[axis] > 0))
+      extent[axis] = 1;
+  }
+
+  std::vector<std::pair<std::uint32_t, BvhPrimitive>> keyed(prims.size());
+  tbb::parallel_for(std::size_t(0), prims.size(), [&](std::size_t i) {
+    const auto p = prims[i].centroid - lo;
+    keyed[i] = {morton_code(Point3(p.x() / extent.x(), p.y() / extent.y(),
+                                   p.z() / extent.z())),
+                prims[i]};
+  });
+  // Ties are broken by the source index so the order is deterministic
+  tbb::parallel_sort(keyed.begin(), keyed.end(),
+                     [](const std::pair<std::uint32_t, BvhPrimitive> &a,
+                        const std::pair<std::uint32_t, BvhPrimitive> &b) {
+                       return a.first != b.first ? a.first < b.first
+                                                 : a.second.index <
+                                                       b.second.index;
+                     });
+
+  std::vector<std::uint32_t> codes(prims.size());
+  tbb::parallel_for(std::size_t(0), prims.size(), [&](std::size_t i) {
+    codes[i] = keyed[i].first;
+    prims[i] = keyed[i].second;
+  });
+  return codes;
+}
+
+inline BvhBuild
+BvhBuilder::build_spatial(std::vector<BvhPrimitive> prims) const {
+  BvhBuild result;
+  if (prims.empty())
+    return result;
+
+  Aabb bounds, centroid_bounds;
+  range_bounds(prims, 0, prims.size(), bounds, centroid_bounds);
+  auto spare = static_cast<std::size_t>(
+      std::max(0.0, options.max_duplication) * prims.size());
+  result.prims.reserve(prims.size() + spare);
+  build_spatial_node(result, std::move(prims), 0,
+                     std::max(bounds.surface_area(), 1e-300), spare);
+  return result;
+}
+
+inline void BvhBuilder::build_spatial_node(BvhBuild &out,
+                                           std::vector<BvhPrimitive> refs,
+                                           int depth, double root_area,
+                                           std::size_t &spare) const {
+  Aabb bounds, centroid_bounds;
+  range_bounds(refs, 0, refs.size(), bounds, centroid_bounds);
+
+  const auto count = refs.size();
+  const auto index = static_cast<std::uint32_t>(out.nodes.size());
+  out.nodes.push_back({bounds, {0, 0},
+                       static_cast<std::uint32_t>(out.prims.size()),
+                       static_cast<std::uint32_t>(count), 0});
+  auto make_leaf = [&] {
+    out.prims.insert(out.prims.end(), refs.begin(), refs.end());
+  };
+  if (count == 1) {
+    make_leaf();
+    return;
+  }
+
+  // The object split partitions refs around split.mid
+  Split split;
+  SpatialSplit spatial;
+  if (depth < max_bvh_depth / 2) {
+    split = find_sah_split(refs, 0, count, bounds, centroid_bounds);
+
+    // Spatial splits only pay off where the object split children overlap
+    auto overlap = 0.0;
+    if (split.axis >= 0) {
+      Aabb left, right, unused;
+      range_bounds(refs, 0, split.mid, left, unused);
+      range_bounds(refs, split.mid, count, right, unused);
+      auto lo = left.min();
+      auto hi = left.max();
+      for (int a = 0; a < 3; a++) {
+        lo[a] = std::max(lo[a], right.min()[a]);
+        hi[a] = std::min(hi[a], right.max()[a]);
+      }
+      overlap = Aabb(lo, hi).surface_area() / root_area;
+    }
+    if (spare > 0 && (split.axis < 0 ||
+                      overlap > options.spatial_split_overlap)) {
+      spatial = find_spatial_split(refs, bounds);
+    }
+  }
+
+  const auto leaf_cost = options.intersection_cost * count;
+  if (count <= static_cast<std::size_t>(options.max_leaf_size) &&
+      leaf_cost <= std::min(split.cost, spatial.cost)) {
+    make_leaf();
+    return;
+  }
+
+  std::vector<BvhPrimitive> left, right;
+  if (spatial.axis >= 0 && spatial.cost < split.cost) {
+    const auto axis = spatial.axis;
+    const auto position = spatial.position;
+    std::size_t duplicated = 0;
+    for (const auto &ref : refs) {
+      if (ref.bounds.max()[axis] <= position) {
+        left.push_back(ref);
+      } else if (ref.bounds.min()[axis] >= position) {
+        right.push_back(ref);
+      } else {
+        auto b = clip_box(ref.bounds, axis, -inf, position);
+        left.push_back({b, b.centroid(), ref.index});
+        b = clip_box(ref.bounds, axis, position, inf);
+        right.push_back({b, b.centroid(), ref.index});
+        duplicated++;
+      }
+    }
+    if (left.empty() || right.empty() || duplicated > spare) {
+      left.clear();
+      right.clear();
+    } else {
+      spare -= duplicated;
+      out.nodes[index].axis = axis;
+    }
+  }
+  if (left.empty()) {
+    if (split.axis < 0) {
+      // All centroids coincide (or the tree is too deep), split in half
+      split.axis = 0;
+      split.mid = count / 2;
+    }
+    left.assign(refs.begin(), refs.begin() + split.mid);
+    right.assign(refs.begin() + split.mid, refs.end());
+    out.nodes[index].axis = split.axis;
+  }
+  refs.clear();
+  refs.shrink_to_fit();
+
+  out.nodes[index].count = 0;
+  out.nodes[index].child[0] = index + 1;
+  build_spatial_node(out, std::move(left), depth + 1, root_area, spare);
+  out.nodes[index].child[1] = static_cast<std::uint32_t>(out.nodes.size());
+  build_spatial_node(out, std::move(right), depth + 1, root_area, spare);
+}
+
+inline BvhBuilder::SpatialSplit
+BvhBuilder::find_spatial_split(const std::vector<BvhPrimitive> &refs,
+                               const Aabb &bounds) const {
+  SpatialSplit best;
+  const int bins = std::max(2, options.bins);
+  const auto area = std::max(bounds.surface_area(), 1e-300);
+
+  std::vector<Bin> bin(bins);
+  std::vector<std::size_t> enter(bins), exit(bins);
+  std::vector<double> right_area(bins);
+  std::vector<std::size_t> right_count(bins);
+  for (int axis = 0; axis < 3; axis++) {
+    const auto lo = bounds.min()[axis];
+    const auto extent = bounds.max()[axis] - lo;
+    if (!(extent > 0))
+      continue;
+    auto plane = [&](int k) {
+      return k == bins ? bounds.max()[axis] : lo + extent * k / bins;
+    };
+    auto bin_of = [&](double x) {
+      auto k = static_cast<int>(bins * ((x - lo) / extent));
+      return std::min(std::max(k, 0), bins - 1);
+    };
+
+    // Every reference is clipped into each bin it overlaps, and counted
+    // where it starts and where it ends
+    std::fill(bin.begin(), bin.end(), Bin());
+    std::fill(enter.begin(), enter.end(), 0);
+    std::fill(exit.begin(), exit.end(), 0);
+    for (const auto &ref : refs) {
+      const auto first = bin_of(ref.bounds.min()[axis]);
+      const auto last = bin_of(ref.bounds.max()[axis]);
+      for (auto k = first; k <= last; k++) {
+        bin[k].bounds = surrounding_box(
+            bin[k].bounds, clip_box(ref.bounds, axis, plane(k), plane(k + 1)));
+      }
+      enter[first]++;
+      exit[last]++;
+    }
+
+    auto box = Aabb::empty();
+    std::size_t n = 0;
+    for (int b = bins - 1; b > 0; b--) {
+      box = surrounding_box(box, bin[b].bounds);
+      n += exit[b];
+      right_area[b] = box.surface_area();
+      right_count[b] = n;
+    }
+
+    box = Aabb::empty();
+    n = 0;
+    for (int b = 0; b < bins - 1; b++) {
+      box = surrounding_box(box, bin[b].bounds);
+      n += enter[b];
+      if (n == 0 || right_count[b + 1] == 0)
+        continue;
+      auto cost = options.traversal_cost +
+                  options.intersection_cost *
+                      (box.surface_area() * n +
+                       right_area[b + 1] * right_count[b + 1]) /
+                      area;
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.position = plane(b + 1);
+      }
+    }
+  }
+  return best;
+}
+
+inline void BvhBuilder::compact(const std::vector<BvhBuildNode> &sparse,
+                                std::uint32_t node,
+                                std::vector<BvhBuildNode> &out) {
+  const auto index = static_cast<std::uint32_t>(out.size());
+  out.push_back(sparse[node]);
+  if (sparse[node].leaf())
+    return;
+  compact(sparse, sparse[node].child[0], out);
+  out[index].child[0] = index + 1;
+  out[index].child[1] = static_cast<std::uint32_t>(out.size());
+  compact(sparse, sparse[node].child[1], out);
+}
+
+inline double BvhBuild::sah_cost(const BvhBuildOptions &options) const {
+  if (nodes.empty())
+    return 0;
+
+  const auto root_area = std::max(nodes[0].bounds.surface_area(), 1e-300);
+  double cost = 0;
+  for (const auto &node : nodes) {
+    const auto weight = node.bounds.surface_area() / root_area;
+    cost += weight * (node.leaf() ? options.intersection_cost * node.count
+                                  : options.traversal_cost);
+  }
+  return cost;
+}
+
+inline void
+BvhBuild::refit(const std::vector<std::shared_ptr<Hittable>> &objects,
+                double time0, double time1) {
+  tbb::parallel_for(std::size_t(0), prims.size(), [&](std::size_t i) {
+    auto &prim = prims[i];
+    if (!objects[prim.index]->bounding_box(time0, time1, prim.bounds)) {
+      std::cerr << "No bounding box in BvhBuild::refit." << std::endl;
+    }
+    prim.centroid = prim.bounds.centroid();
+  });
+
+  // Nodes are in depth first order, so walking backwards reaches both
+  // children before their parent
+  for (auto i = nodes.size(); i-- > 0;) {
+    auto &node = nodes[i];
+    if (node.leaf()) {
+      node.bounds = Aabb::empty();
+      for (auto p = node.first; p < node.first + node.count; p++) {
+        node.bounds = surrounding_box(node.bounds, prims[p].bounds);
+      }
+    } else {
+      node.bounds = surrounding_box(nodes[node.child[0]].bounds,
+                                    nodes[node.child[1]].bounds);
+    }
+  }
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "mapped_file.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+/**
+ * BVH cache files hold a finished BvhBuild, so scenes rendered again with a
+ * different camera, sample count or crop skip the build.
+ *
+ * A file is named after a hash of everything the build depends on: the
+ * bounds of every primitive in object order and the build options. Scenes
+ * are generated the same way every run, so the same scene finds its file
+ * again, and any change to the geometry or options misses it. The build
+ * only depends on bounds, so changing materials keeps the cache valid.
+ *
+ * Only the binary build is cached, not the layouts made from it. Collapsing
+ * it into Bvh4 or Bvh8 nodes and laying those out in treelets is a linear
+ * pass, about a tenth of the SAH build over a million spheres, and one file
+ * then serves every layout, so switching --accel keeps the cache.
+ *
+ * Files are written through a memory map into path.tmp, synced and renamed
+ * over path, and read back through a read-only map. A file that does not
+ * describe a valid tree over the objects is rebuilt, as a hash collision or
+ * a damaged file must not send traversal outside its arrays.
+ */
+struct BvhCacheHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t node_size;
+  std::uint32_t prim_size;
+  std::uint32_t pad;
+  std::uint64_t key;
+  std::uint64_t node_count;
+  std::uint64_t prim_count;
+};
+
+// Fixed layout records, BvhBuildNode and BvhPrimitive hold Vec3s
+struct BvhCacheNode {
+  double min[3];
+  double max[3];
+  std::uint32_t child[2];
+  std::uint32_t first;
+  std::uint32_t count;
+  std::int32_t axis;
+  std::uint32_t pad;
+};
+
+struct BvhCachePrimitive {
+  double min[3];
+  double max[3];
+  std::uint64_t index;
+};
+
+const char bvh_cache_magic[8] = {'R', 'T', 'B', 'V', 'H', '\0', '\0', '\0'};
+const std::uint32_t bvh_cache_version = 1;
+
+// Hash of the primitives, in the order given, and the build options
+inline std::uint64_t bvh_cache_key(const std::vector<BvhPrimitive> &prims,
+                                   const BvhBuildOptions &options) {
+  std::uint64_t key = bvh_cache_version;
+  auto add = [&key](std::uint64_t v) { key = Sampler::mix(key ^ v) + v; };
+  auto add_double = [&add](double x) {
+    std::uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    add(bits);
+  };
+
+  add(static_cast<std::uint64_t>(options.split));
+  add(static_cast<std::uint64_t>(options.max_leaf_size));
+  add(static_cast<std::uint64_t>(options.bins));
+  add_double(options.traversal_cost);
+  add_double(options.intersection_cost);
+  add_double(options.max_duplication);
+  add_double(options.spatial_split_overlap);
+  add(prims.size());
+  for (const auto &prim : prims) {
+    for (int a = 0; a < 3; a++) {
+      add_double(prim.bounds.min()[a]);
+      add_double(prim.bounds.max()[a]);
+    }
+  }
+  return key;
+}
+
+inline std::string bvh_cache_path(const std::string &dir, std::uint64_t key) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "bvh-%016llx.cache",
+                static_cast<unsigned long long>(key));
+  return dir + "/" + name;
+}
+
+inline bool save_bvh_cache(const std::string &path, std::uint64_t key,
+                           const BvhBuild &build) {
+  const auto tmp_path = path + ".tmp";
+  const auto size = sizeof(BvhCacheHeader) +
+                    build.nodes.size() * sizeof(BvhCacheNode) +
+                    build.prims.size() * sizeof(BvhCachePrimitive);
+
+  MappedFile file;
+  if (!file.create(tmp_path, size))
+    return false;
+
+  BvhCacheHeader header;
+  std::memcpy(header.magic, bvh_cache_magic, sizeof(header.magic));
+  header.version = bvh_cache_version;
+  header.node_size = sizeof(BvhCacheNode);
+  header.prim_size = sizeof(BvhCachePrimitive);
+  header.pad = 0;
+  header.key = key;
+  header.node_count = build.nodes.size();
+  header.prim_count = build.prims.size();
+  std::memcpy(file.data(), &header, sizeof(header));
+
+  auto out = file.data() + sizeof(header);
+  for (const auto &node : build.nodes) {
+    BvhCacheNode record;
+    for (int a = 0; a < 3; a++) {
+      record.min[a] = node.bounds.min()[a];
+      record.max[a] = node.bounds.max()[a];
+    }
+    record.child[0] = node.child[0];
+    record.child[1] = node.child[1];
+    record.first = node.first;
+    record.count = node.count;
+    record.axis = node.axis;
+    record.pad = 0;
+    std::memcpy(out, &record, sizeof(record));
+    out += sizeof(record);
+  }
+  for (const auto &prim : build.prims) {
+    BvhCachePrimitive record;
+    for (int a = 0; a < 3; a++) {
+      record.min[a] = prim.bounds.min()[a];
+      record.max[a] = prim.bounds.max()[a];
+    }
+    record.index = prim.index;
+    std::memcpy(out, &record, sizeof(record));
+    out += sizeof(record);
+  }
+
+  if (!file.sync())
+    return false;
+  file.close();
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+// Whether build is a tree traversal can walk over object_count objects:
+// children come after their parent in depth first order, every node but the
+// root has one parent, depths stay below max_bvh_depth and leaves reference
+// primitives that exist. Only Sbvh builds reference an object more than once.
+// Leaves hold at most options.max_leaf_size primitives, and no more than the
+// 8 bit counts of WideBvhNode and QuantizedBvhNode, the narrowest layouts.
+inline bool valid_bvh_build(const BvhBuild &build, std::size_t object_count,
+                            const BvhBuildOptions &options) {
+  const auto node_count = build.nodes.size();
+  const auto prim_count = build.prims.size();
+  if (options.split == BvhSplit::Sbvh ? prim_count < object_count
+                                      : prim_count != object_count)
+    return false;
+  if ((node_count == 0) != (prim_count == 0))
+    return false;
+  for (const auto &prim : build.prims) {
+    if (prim.index >= object_count)
+      return false;
+  }
+
+  const auto max_leaf =
+      std::min(options.max_leaf_size,
+               static_cast<int>(std::numeric_limits<std::uint8_t>::max()));
+  std::vector<int> depth(node_count, -1);
+  if (node_count > 0)
+    depth[0] = 0;
+  for (std::size_t i = 0; i < node_count; i++) {
+    const auto &node = build.nodes[i];
+    if (depth[i] < 0 || node.axis < 0 || node.axis > 2)
+      return false;
+    if (node.count > 0) {
+      if (static_cast<std::size_t>(node.first) + node.count > prim_count ||
+          node.count > static_cast<std::uint32_t>(max_leaf))
+        return false;
+      continue;
+    }
+    for (auto child : node.child) {
+      if (child <= i || child >= node_count || depth[child] >= 0 ||
+          depth[i] + 1 >= max_bvh_depth)
+        return false;
+      depth[child] = depth[i] + 1;
+    }
+  }
+  return true;
+}
+
+// Returns false, quietly, when there is no usable file for key at path. The
+// file must hold a valid tree over object_count objects built with options.
+inline bool load_bvh_cache(const std::string &path, std::uint64_t key,
+                           std::size_t object_count,
+                           const BvhBuildOptions &options, BvhBuild &build) {
+  MappedFile file;
+  if (!file.open(path))
+    return false;
+
+  BvhCacheHeader header;
+  if (file.size() < sizeof(header))
+    return false;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, bvh_cache_magic, sizeof(header.magic)) != 0 ||
+      header.version != bvh_cache_version ||
+      header.node_size != sizeof(BvhCacheNode) ||
+      header.prim_size != sizeof(BvhCachePrimitive) || header.key != key)
+    return false;
+  if (file.size() != sizeof(header) +
+                         header.node_count * sizeof(BvhCacheNode) +
+                         header.prim_count * sizeof(BvhCachePrimitive)) {
+    std::cerr << "ERROR: BVH cache '" << path << "' is truncated.\n";
+    return false;
+  }
+
+  auto in = file.data() + sizeof(header);
+  build.nodes.resize(header.node_count);
+  for (auto &node : build.nodes) {
+    BvhCacheNode record;
+    std::memcpy(&record, in, sizeof(record));
+    node.bounds = Aabb(Point3(record.min[0], record.min[1], record.min[2]),
+                       Point3(record.max[0], record.max[1], record.max[2]));
+    node.child[0] = record.child[0];
+    node.child[1] = record.child[1];
+    node.first = record.first;
+    node.count = record.count;
+    node.axis = record.axis;
+    in += sizeof(record);
+  }
+  build.prims.resize(header.prim_count);
+  for (auto &prim : build.prims) {
+    BvhCachePrimitive record;
+    std::memcpy(&record, in, sizeof(record));
+    prim.bounds = Aabb(Point3(record.min[0], record.min[1], record.min[2]),
+                       Point3(record.max[0], record.max[1], record.max[2]));
+    prim.centroid = prim.bounds.centroid();
+    prim.index = record.index;
+    in += sizeof(record);
+  }
+  if (!valid_bvh_build(build, object_count, options)) {
+    std::cerr << "ERROR: BVH cache '" << path
+              << "' does not hold a valid tree, rebuilding.\n";
+    build = BvhBuild();
+    return false;
+  }
+  return true;
+}
+
+/**
+ * The build over prims from the cache in dir, or built and saved there when
+ * it is not cached yet. The median builder draws random axes, so its builds
+ * depend on more than the key and are never cached.
+ */
+inline BvhBuild cached_bvh_build(std::vector<BvhPrimitive> prims,
+                                 const BvhBuildOptions &options,
+                                 const std::string &dir) {
+  if (dir.empty() || options.split == BvhSplit::Median)
+    return BvhBuilder(options).build(std::move(prims));
+
+  const auto key = bvh_cache_key(prims, options);
+  const auto path = bvh_cache_path(dir, key);
+  BvhBuild build;
+  if (load_bvh_cache(path, key, prims.size(), options, build))
+    return build;
+
+  build = BvhBuilder(options).build(std::move(prims));
+  if (!save_bvh_cache(path, key, build)) {
+    std::cerr << "ERROR: Could not write BVH cache '" << path << "'.\n";
+  }
+  return build;
+}
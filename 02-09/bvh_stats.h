@@ -0,0 +1,259 @@
+#pragma once
+
+#include "accelerator.h"
+#include "bvh.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "kd_tree.h"
+#include "lazy_bvh.h"
+#include "linear_bvh.h"
+#include "motion_bvh.h"
+#include "quantized_bvh.h"
+#include "ray.h"
+#include "uniform_grid.h"
+#include "wide_bvh.h"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+/**
+ * How good a hierarchy is: its shape, its SAH cost, the memory of the layout
+ * it is stored in, and how much work closest hit queries for a set of rays
+ * take. Traversal counts are for the binary hierarchy, so they compare
+ * builders, not layouts.
+ */
+struct BvhStats {
+  std::size_t nodes = 0;
+  std::size_t leaves = 0;
+  std::size_t primitives = 0;
+  int max_depth = 0;
+  std::vector<std::size_t> leaf_depths; // leaves at each depth, root at 0
+  std::vector<std::size_t> leaf_sizes;  // leaves with each primitive count
+  double sah_cost = 0;
+  std::size_t memory_bytes = 0; // nodes and primitive references
+
+  std::size_t rays = 0;
+  double nodes_per_ray = 0;      // boxes tested
+  double primitives_per_ray = 0; // primitive hit calls
+  double hit_fraction = 0;
+};
+
+// Closest hit through the binary hierarchy like LinearBvh, counting the
+// boxes and primitives tested
+inline bool
+trace_counting(const BvhBuild &build,
+               const std::vector<std::shared_ptr<Hittable>> &objects,
+               const Ray &r, double t_min, double t_max, std::size_t &nodes,
+               std::size_t &primitives) {
+  if (build.nodes.empty())
+    return false;
+
+  std::uint32_t stack[max_bvh_depth];
+  int top = 0;
+  std::uint32_t current = 0;
+  bool hit_anything = false;
+  HitRecord rec;
+
+  while (true) {
+    const auto &node = build.nodes[current];
+    nodes++;
+    if (node.bounds.hit(r, t_min, t_max)) {
+      if (node.leaf()) {
+        for (auto i = node.first; i < node.first + node.count; i++) {
+          primitives++;
+          if (objects[build.prims[i].index]->hit(r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+          }
+        }
+      } else {
+        const auto near = r.getSign(node.axis);
+        stack[top++] = node.child[1 - near];
+        current = node.child[near];
+        continue;
+      }
+    }
+    if (top == 0)
+      break;
+    current = stack[--top];
+  }
+  return hit_anything;
+}
+
+// Bytes taken by the nodes and primitive references of accelerator, made
+// from build with make_accelerator. Allocator overhead is not counted.
+inline std::size_t accelerator_bytes(const Hittable &accelerator,
+                                     const BvhBuild &build,
+                                     Accelerator type) {
+  const auto references = build.prims.size() *
+                          (sizeof(const Hittable *) +
+                           sizeof(std::shared_ptr<Hittable>));
+  switch (type) {
+  case Accelerator::BvhLinear:
+    return dynamic_cast<const LinearBvh &>(accelerator).node_array().size() *
+               sizeof(LinearBvhNode) +
+           references;
+  case Accelerator::Bvh4:
+    return dynamic_cast<const Bvh4 &>(accelerator).node_array().size() *
+               sizeof(WideBvhNode<4>) +
+           references;
+  case Accelerator::Bvh8:
+    return dynamic_cast<const Bvh8 &>(accelerator).node_array().size() *
+               sizeof(WideBvhNode<8>) +
+           references;
+  case Accelerator::BvhMotion:
+    return dynamic_cast<const MotionBvh &>(accelerator).node_array().size() *
+               sizeof(MotionBvhNode) +
+           references;
+  case Accelerator::BvhQuantized:
+    return dynamic_cast<const QuantizedBvh &>(accelerator)
+                   .node_array()
+                   .size() *
+               sizeof(QuantizedBvhNode) +
+           references;
+  case Accelerator::Grid: {
+    const auto &grid = dynamic_cast<const UniformGrid &>(accelerator);
+    return (grid.cell_count() + 1) * sizeof(std::uint32_t) +
+           grid.reference_count() * sizeof(const Hittable *) +
+           build.prims.size() * sizeof(std::shared_ptr<Hittable>);
+  }
+  case Accelerator::KdTree: {
+    const auto &tree = dynamic_cast<const KdTree &>(accelerator);
+    return tree.node_array().size() * sizeof(KdTreeNode) +
+           tree.reference_count() * sizeof(const Hittable *) +
+           build.prims.size() * sizeof(std::shared_ptr<Hittable>);
+  }
+  case Accelerator::BvhLazy:
+    return dynamic_cast<const LazyBvh &>(accelerator).memory_bytes();
+  case Accelerator::BvhTree:
+    break;
+  }
+
+  // A BvhNode per interior node, leaves of several primitives are lists
+  std::size_t bytes = 0;
+  for (const auto &node : build.nodes) {
+    if (!node.leaf()) {
+      bytes += sizeof(BvhNode);
+    } else if (node.count > 1) {
+      bytes += sizeof(HittableList) +
+               node.count * sizeof(std::shared_ptr<Hittable>);
+    }
+  }
+  return bytes;
+}
+
+inline BvhStats bvh_stats(const BvhBuild &build, const BvhBuildOptions &options,
+                          const std::vector<std::shared_ptr<Hittable>> &objects,
+                          const std::vector<Ray> &rays) {
+  BvhStats stats;
+  stats.nodes = build.nodes.size();
+  stats.primitives = build.prims.size();
+  stats.sah_cost = build.sah_cost(options);
+
+  std::vector<std::pair<std::uint32_t, int>> stack;
+  if (!build.nodes.empty())
+    stack.push_back({0, 0});
+  while (!stack.empty()) {
+    const auto [index, depth] = stack.back();
+    stack.pop_back();
+    const auto &node = build.nodes[index];
+    if (!node.leaf()) {
+      stack.push_back({node.child[0], depth + 1});
+      stack.push_back({node.child[1], depth + 1});
+      continue;
+    }
+    stats.leaves++;
+    stats.max_depth = std::max(stats.max_depth, depth);
+    if (stats.leaf_depths.size() <= static_cast<std::size_t>(depth))
+      stats.leaf_depths.resize(depth + 1);
+    stats.leaf_depths[depth]++;
+    if (stats.leaf_sizes.size() <= node.count)
+      stats.leaf_sizes.resize(node.count + 1);
+    stats.leaf_sizes[node.count]++;
+  }
+
+  std::size_t nodes = 0, primitives = 0, hits = 0;
+  for (const auto &ray : rays) {
+    hits += trace_counting(build, objects, ray, 0.001, inf, nodes, primitives);
+  }
+  stats.rays = rays.size();
+  if (!rays.empty()) {
+    stats.nodes_per_ray = static_cast<double>(nodes) / rays.size();
+    stats.primitives_per_ray = static_cast<double>(primitives) / rays.size();
+    stats.hit_fraction = static_cast<double>(hits) / rays.size();
+  }
+  return stats;
+}
+
+inline const char *accelerator_name(Accelerator type) {
+  switch (type) {
+  case Accelerator::BvhTree:
+    return "tree";
+  case Accelerator::BvhLinear:
+    return "linear";
+  case Accelerator::Bvh4:
+    return "bvh4";
+  case Accelerator::Bvh8:
+    return "bvh8";
+  case Accelerator::BvhMotion:
+    return "motion";
+  case Accelerator::BvhQuantized:
+    return "quantized";
+  case Accelerator::Grid:
+    return "grid";
+  case Accelerator::KdTree:
+    return "kdtree";
+  case Accelerator::BvhLazy:
+    return "lazy";
+  }
+  return "";
+}
+
+inline const char *bvh_split_name(BvhSplit split) {
+  switch (split) {
+  case BvhSplit::Median:
+    return "median";
+  case BvhSplit::Sah:
+    return "sah";
+  case BvhSplit::Lbvh:
+    return "lbvh";
+  case BvhSplit::Sbvh:
+    return "sbvh";
+  }
+  return "";
+}
+
+// Writes stats of the hierarchy named subtree as one line of JSON, with the
+// options they were made with
+inline void print_bvh_stats_json(std::ostream &out, const char *subtree,
+                                 const BvhStats &stats,
+                                 const AcceleratorOptions &options) {
+  auto array = [&out](const std::vector<std::size_t> &values) {
+    out << "[";
+    for (std::size_t i = 0; i < values.size(); i++) {
+      out << (i > 0 ? "," : "") << values[i];
+    }
+    out << "]";
+  };
+
+  out << "{\"subtree\":\"" << subtree << "\""
+      << ",\"layout\":\"" << accelerator_name(options.type) << "\""
+      << ",\"builder\":\"" << bvh_split_name(options.bvh.split) << "\""
+      << ",\"max_leaf_size\":" << options.bvh.max_leaf_size
+      << ",\"nodes\":" << stats.nodes << ",\"leaves\":" << stats.leaves
+      << ",\"primitives\":" << stats.primitives
+      << ",\"max_depth\":" << stats.max_depth << ",\"leaf_depths\":";
+  array(stats.leaf_depths);
+  out << ",\"leaf_sizes\":";
+  array(stats.leaf_sizes);
+  out << ",\"sah_cost\":" << stats.sah_cost
+      << ",\"memory_bytes\":" << stats.memory_bytes
+      << ",\"rays\":" << stats.rays
+      << ",\"nodes_per_ray\":" << stats.nodes_per_ray
+      << ",\"primitives_per_ray\":" << stats.primitives_per_ray
+      << ",\"hit_fraction\":" << stats.hit_fraction << "}" << std::endl;
+}
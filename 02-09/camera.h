@@ -2,6 +2,7 @@
 
 #include "ray.h"
 #include "rtweekend.h"
+#include "sampler.h"
 #include "vec3.h"
 #include <cmath>
 
@@ -28,14 +29,14 @@ public:
     lens_radius = aperture / 2;
   }
 
-  Ray get_ray(double s, double t) const {
-    Vec3 rd = lens_radius * random_in_unit_disk();
+  Ray get_ray(double s, double t, Sampler &sampler) const {
+    Vec3 rd = lens_radius * random_in_unit_disk(sampler);
     Vec3 offset = u * rd.x() + v * rd.y();
 
     return Ray(origin + offset,
                lower_left_corner + s * horizontal + t * vertical - origin -
                    offset,
-               random_double(time0, time1));
+               sampler.random_double(time0, time1));
   }
 
 private:
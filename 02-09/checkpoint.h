@@ -0,0 +1,152 @@
+#pragma once
+
+#include "film.h"
+#include "mapped_file.h"
+#include "pixel_stats.h"
+#include "sampler.h"
+#include "vec3.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+/**
+ * Checkpoint files hold everything needed to carry on with a render: the
+ * film, the number of finished passes and a fingerprint of the scene and
+ * settings the film was rendered with.
+ *
+ * Random numbers are counter-based, so a pixel's sample count is also its
+ * position in its random stream. Resuming picks up exactly where the
+ * interrupted run stopped and gives the same image as an uninterrupted run.
+ *
+ * The file is written through a memory map into path.tmp and then renamed
+ * over path, so a crash while writing leaves the previous checkpoint intact.
+ */
+struct CheckpointHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t record_size;
+  std::uint64_t width;
+  std::uint64_t height;
+  std::uint64_t passes;
+  std::uint64_t fingerprint;
+};
+
+const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '\0', '\0'};
+const std::uint32_t checkpoint_version = 2;
+
+/**
+ * Hash of everything that decides what a sample adds to the film. Samples
+ * of another scene, camera or integrator would blend silently into a resumed
+ * film, so resuming requires the fingerprint to match.
+ */
+class CheckpointFingerprint {
+public:
+  void add(std::uint64_t v) { key = Sampler::mix(key ^ v) + v; }
+
+  void add_double(double x) {
+    std::uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    add(bits);
+  }
+
+  void add_vec(const Vec3 &v) {
+    for (int a = 0; a < 3; a++) {
+      add_double(v[a]);
+    }
+  }
+
+  std::uint64_t value() const { return key; }
+
+private:
+  std::uint64_t key = checkpoint_version;
+};
+
+inline bool save_checkpoint(const std::string &path, const Film &film,
+                            int passes, std::uint64_t fingerprint) {
+  const auto tmp_path = path + ".tmp";
+  const auto pixels = film.width * film.height;
+  const auto size =
+      sizeof(CheckpointHeader) + pixels * sizeof(PixelStats::Record);
+
+  MappedFile file;
+  if (!file.create(tmp_path, size))
+    return false;
+
+  CheckpointHeader header;
+  std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+  header.version = checkpoint_version;
+  header.record_size = sizeof(PixelStats::Record);
+  header.width = film.width;
+  header.height = film.height;
+  header.passes = passes;
+  header.fingerprint = fingerprint;
+  std::memcpy(file.data(), &header, sizeof(header));
+
+  auto out = file.data() + sizeof(header);
+  for (std::size_t y = 0; y < film.height; ++y) {
+    for (std::size_t x = 0; x < film.width; ++x) {
+      const auto record = film.at(x, y).record();
+      std::memcpy(out, &record, sizeof(record));
+      out += sizeof(record);
+    }
+  }
+
+  if (!file.sync())
+    return false;
+  file.close();
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+inline bool load_checkpoint(const std::string &path, Film &film, int &passes,
+                            std::uint64_t fingerprint) {
+  MappedFile file;
+  if (!file.open(path)) {
+    std::cerr << "ERROR: Could not open checkpoint '" << path << "'.\n";
+    return false;
+  }
+
+  CheckpointHeader header;
+  const auto pixels = film.width * film.height;
+  if (file.size() < sizeof(header)) {
+    std::cerr << "ERROR: Checkpoint '" << path << "' is truncated.\n";
+    return false;
+  }
+  std::memcpy(&header, file.data(), sizeof(header));
+
+  if (std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 ||
+      header.version != checkpoint_version ||
+      header.record_size != sizeof(PixelStats::Record)) {
+    std::cerr << "ERROR: '" << path << "' is not a compatible checkpoint.\n";
+    return false;
+  }
+  if (header.width != film.width || header.height != film.height) {
+    std::cerr << "ERROR: Checkpoint '" << path << "' is " << header.width
+              << "x" << header.height << ", not " << film.width << "x"
+              << film.height << ".\n";
+    return false;
+  }
+  if (header.fingerprint != fingerprint) {
+    std::cerr << "ERROR: Checkpoint '" << path
+              << "' was rendered with a different scene or settings.\n";
+    return false;
+  }
+  if (file.size() != sizeof(header) + pixels * sizeof(PixelStats::Record)) {
+    std::cerr << "ERROR: Checkpoint '" << path << "' is truncated.\n";
+    return false;
+  }
+
+  auto in = file.data() + sizeof(header);
+  for (std::size_t y = 0; y < film.height; ++y) {
+    for (std::size_t x = 0; x < film.width; ++x) {
+      PixelStats::Record record;
+      std::memcpy(&record, in, sizeof(record));
+      film.at(x, y) = PixelStats::from_record(record);
+      in += sizeof(record);
+    }
+  }
+  passes = static_cast<int>(header.passes);
+  return true;
+}
@@ -1,12 +1,15 @@
 #pragma once
 
 #include "rtweekend.h"
+#include "sampler.h"
 
 #include "hittable.h"
 #include "material.h"
 #include "texture.h"
 #include "isotropic.h"
 
+#include <cstring>
+
 class ConstantMedium : public Hittable {
     public:
     ConstantMedium(std::shared_ptr<Hittable> b, double d, std::shared_ptr<Texture> a) : boundary(b), neg_inv_density(-1/d), phase_function(std::make_shared<Isotropic>(a)) {}
@@ -15,20 +18,40 @@ class ConstantMedium : public Hittable {
 
     virtual bool hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const override;
 
+    // The same random scattering as hit, so shadow rays agree with it, without
+    // filling in a record
+    virtual bool occluded(const Ray &r, double t_min, double t_max) const override;
+
     virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override {
         return boundary->bounding_box(time0, time1, output_box);
     }
 
     private:
+    static std::uint64_t ray_key(const Ray &r);
+
+    // Where r scatters inside the medium between t_min and t_max, false if it
+    // passes through
+    bool scatter_t(const Ray &r, double t_min, double t_max, Sampler &sampler, double &t) const;
+
     std::shared_ptr<Hittable> boundary;
     std::shared_ptr<Material> phase_function;
     double neg_inv_density;
 };
 
-bool ConstantMedium::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const {
-    const bool enableDebug = false;
-    const bool debugging = enableDebug && random_double() < 0.00001;
+inline std::uint64_t ConstantMedium::ray_key(const Ray &r) {
+    const double values[] = {r.origin().x(),    r.origin().y(),    r.origin().z(),
+                             r.direction().x(), r.direction().y(), r.direction().z(),
+                             r.time()};
+    std::uint64_t key = 0;
+    for (auto value : values) {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        key = Sampler::mix(key ^ bits);
+    }
+    return key;
+}
 
+inline bool ConstantMedium::scatter_t(const Ray &r, double t_min, double t_max, Sampler &sampler, double &t) const {
     HitRecord rec1, rec2;
 
     if (!boundary->hit(r, -inf, inf, rec1)) {
@@ -39,8 +62,6 @@ bool ConstantMedium::hit(const Ray &r, double t_min, double t_max, HitRecord &re
         return false;
     }
 
-    if (debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
-
     if (rec1.t < t_min) rec1.t = t_min;
     if (rec2.t > t_max) rec2.t = t_max;
 
@@ -54,18 +75,30 @@ bool ConstantMedium::hit(const Ray &r, double t_min, double t_max, HitRecord &re
 
     const auto ray_length = r.direction().length();
     const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    const auto hit_distance = neg_inv_density * log(random_double());
+    const auto hit_distance = neg_inv_density * log(sampler.random_double());
 
     if (hit_distance > distance_inside_boundary) {
         return false;
     }
 
-    rec.t = rec1.t + hit_distance / ray_length;
+    t = rec1.t + hit_distance / ray_length;
+    return true;
+}
+
+inline bool ConstantMedium::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const {
+    const bool enableDebug = false;
+    // Hittable::hit is not handed a Sampler so key one on the ray itself,
+    // which keeps the result independent of the thread tracing it
+    Sampler sampler(ray_key(r), 0);
+    const bool debugging = enableDebug && sampler.random_double() < 0.00001;
+
+    if (!scatter_t(r, t_min, t_max, sampler, rec.t)) {
+        return false;
+    }
     rec.p = r.at(rec.t);
 
     if (debugging) {
-        std::cerr << "hit_distance = " << hit_distance << '\n'
-        << "rec.t = " << rec.t << '\n'
+        std::cerr << "rec.t = " << rec.t << '\n'
         << "rec.p = " << rec.p << '\n';
     }
 
@@ -74,4 +107,10 @@ bool ConstantMedium::hit(const Ray &r, double t_min, double t_max, HitRecord &re
     rec.mat_ptr = phase_function;
 
     return true;
-}
\ No newline at end of file
+}
+
+inline bool ConstantMedium::occluded(const Ray &r, double t_min, double t_max) const {
+    Sampler sampler(ray_key(r), 0);
+    double t;
+    return scatter_t(r, t_min, t_max, sampler, t);
+}
@@ -6,8 +6,8 @@ class Dielectric final : public Material {
 public:
   Dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
-  bool scatter(const Ray &r_in, const HitRecord &rec,
-                       Color &attentuation, Ray &scattered) const override {
+  bool scatter(const Ray &r_in, const HitRecord &rec, Color &attentuation,
+               Ray &scattered, Sampler &sampler) const override {
     attentuation = Color(1.0, 1.0, 1.0);
     double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
@@ -17,7 +17,7 @@ public:
 
     Vec3 direction =
         refraction_ratio * sin_theta > 1.0 ||
-                reflectance(cos_theta, refraction_ratio) > random_double()
+                reflectance(cos_theta, refraction_ratio) > sampler.random_double()
             ? reflect(unit_direction, rec.normal)
             : refract(unit_direction, rec.normal, refraction_ratio);
 
@@ -7,7 +7,8 @@ public:
   DiffuseLight(Color c) : emit(std::make_shared<SolidColor>(c)) {}
 
   virtual bool scatter(const Ray &r_in, const HitRecord &rec,
-                       Color &attentuation, Ray &scattered) const override {
+                       Color &attentuation, Ray &scattered,
+                       Sampler &sampler) const override {
     return false;
   }
 
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "aabb.h"
+#include "accelerator.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray.h"
+
+#include <memory>
+
+/**
+ * A BVH for frame sequences in which objects move between frames.
+ *
+ * update() refits the hierarchy to where the objects are now instead of
+ * building it again, and stores the refitted build in the layout chosen by
+ * options. A refit never changes the tree, so as objects drift away from
+ * where they were built its quality drops. Once the SAH cost grows past
+ * rebuild_threshold times the cost right after the last full build, update()
+ * rebuilds from scratch instead.
+ */
+class DynamicBvh : public Hittable {
+public:
+  DynamicBvh(const HittableList &list, double time0, double time1,
+             const AcceleratorOptions &options, double rebuild_threshold = 1.5)
+      : options(options), rebuild_threshold(rebuild_threshold) {
+    rebuild(list, time0, time1);
+  }
+
+  // Call after objects in list moved or were replaced. list must hold the
+  // same objects in the same order as before, otherwise it is rebuilt.
+  // Returns true when it rebuilt.
+  bool update(const HittableList &list, double time0, double time1);
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   HitRecord &rec) const override {
+    return accelerator->hit(r, t_min, t_max, rec);
+  }
+
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override {
+    return accelerator->occluded(r, t_min, t_max);
+  }
+
+  virtual bool bounding_box(double time0, double time1,
+                            Aabb &output_box) const override {
+    return accelerator->bounding_box(time0, time1, output_box);
+  }
+
+  double sah_cost() const { return cost; }
+  double built_sah_cost() const { return built_cost; }
+
+private:
+  void rebuild(const HittableList &list, double time0, double time1);
+
+  AcceleratorOptions options;
+  double rebuild_threshold;
+  BvhBuild build;
+  std::size_t object_count = 0; // build.prims has more with spatial splits
+  double cost = 0;       // of the current tree
+  double built_cost = 0; // right after the last full build
+  std::shared_ptr<Hittable> accelerator;
+};
+
+inline void DynamicBvh::rebuild(const HittableList &list, double time0,
+                                double time1) {
+  build = BvhBuilder(options.bvh).build(
+      bvh_primitives(list.objects, time0, time1));
+  object_count = list.objects.size();
+  cost = built_cost = build.sah_cost(options.bvh);
+  accelerator = make_accelerator(build, list.objects, time0, time1, options);
+}
+
+inline bool DynamicBvh::update(const HittableList &list, double time0,
+                               double time1) {
+  if (list.objects.size() != object_count) {
+    rebuild(list, time0, time1);
+    return true;
+  }
+
+  build.refit(list.objects, time0, time1);
+  cost = build.sah_cost(options.bvh);
+  if (cost > rebuild_threshold * built_cost) {
+    rebuild(list, time0, time1);
+    return true;
+  }
+  accelerator = make_accelerator(build, list.objects, time0, time1, options);
+  return false;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "pixel_stats.h"
+#include "vec3.h"
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Floating point accumulation buffer for progressive rendering.
+ *
+ * Each pass adds samples to the pixels it visits and the 8-bit Image is
+ * only developed from the film when a snapshot is written, so passes can
+ * keep refining the estimate for as long as the render runs.
+ */
+class Film {
+public:
+  Film(std::size_t width, std::size_t height)
+      : width(width), height(height), pixels(width * height) {}
+
+  PixelStats &at(std::size_t x, std::size_t y) {
+    return pixels[width * y + x];
+  }
+  const PixelStats &at(std::size_t x, std::size_t y) const {
+    return pixels[width * y + x];
+  }
+
+  unsigned long long total_samples() const {
+    unsigned long long total = 0;
+    for (const auto &pixel : pixels) {
+      total += pixel.samples();
+    }
+    return total;
+  }
+
+  const std::size_t width;
+  const std::size_t height;
+
+private:
+  std::vector<PixelStats> pixels;
+};
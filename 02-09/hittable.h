@@ -33,6 +33,15 @@ public:
   // returns information in the HitRecord
   virtual bool hit(const Ray &r, double t_min, double t_max,
                    HitRecord &rec) const = 0;
+
+  // True when anything is hit between t_min and t_max. For shadow and
+  // visibility rays: it may stop at the first hit found, not the closest,
+  // and fills no HitRecord. Only falls back to hit when not overridden.
+  virtual bool occluded(const Ray &r, double t_min, double t_max) const {
+    HitRecord rec;
+    return hit(r, t_min, t_max, rec);
+  }
+
   virtual bool bounding_box(double time0, double time1,
                             Aabb &output_box) const = 0;
 
@@ -43,6 +52,9 @@ class Translate final : public Hittable {
     public:
     Translate(std::shared_ptr<Hittable> p, const Vec3 &displacement) : ptr(p), offset(displacement) {}
     bool hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const override;
+    bool occluded(const Ray &r, double t_min, double t_max) const override {
+        return ptr->occluded(Ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+    }
     virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override;
 
     private:
@@ -76,12 +88,19 @@ class rotateY : public Hittable {
 
     virtual bool hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const override;
 
+    virtual bool occluded(const Ray &r, double t_min, double t_max) const override {
+        return ptr->occluded(rotate(r), t_min, t_max);
+    }
+
     virtual bool bounding_box(double time0, double time1, Aabb &output_box) const override {
         output_box = bbox;
         return hasbox;
     }
 
     private:
+    // The ray in the object's unrotated frame
+    Ray rotate(const Ray &r) const;
+
     std::shared_ptr<Hittable> ptr;
     double sin_theta;
     double cos_theta;
@@ -121,7 +140,7 @@ rotateY::rotateY(std::shared_ptr<Hittable> p, double angle) : ptr(p) {
     bbox = Aabb(min, max);
 }
 
-bool rotateY::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const {
+Ray rotateY::rotate(const Ray &r) const {
     auto origin = r.origin();
     auto direction = r.direction();
 
@@ -131,7 +150,11 @@ bool rotateY::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) cons
     direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
     direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
 
-    Ray rotated_r(origin, direction, r.time());
+    return Ray(origin, direction, r.time());
+}
+
+bool rotateY::hit(const Ray &r, double t_min, double t_max, HitRecord &rec) const {
+    Ray rotated_r = rotate(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec)) {
         return false;
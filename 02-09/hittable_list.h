@@ -16,6 +16,8 @@ public:
 
   virtual bool hit(const Ray &r, double t_min, double t_max,
                    HitRecord &rec) const override;
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
   virtual bool bounding_box(double time0, double time1,
                             Aabb &output_box) const override;
 
@@ -39,6 +41,15 @@ inline bool HittableList::hit(const Ray &r, double t_min, double t_max,
   return hit_anything;
 }
 
+inline bool HittableList::occluded(const Ray &r, double t_min,
+                                   double t_max) const {
+  for (const auto &object : objects) {
+    if (object->occluded(r, t_min, t_max))
+      return true;
+  }
+  return false;
+}
+
 inline bool HittableList::bounding_box(double time0, double time1,
                                        Aabb &output_box) const {
   if (objects.empty())
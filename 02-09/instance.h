@@ -0,0 +1,59 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "ray.h"
+#include "transform.h"
+
+#include <memory>
+
+/**
+ * One placement of shared geometry, usually a bottom level BVH built once
+ * with make_accelerator. An instance only stores the transform, its inverse
+ * and a reference, so the same geometry can be placed any number of times.
+ * A BVH over a list of instances is the top level structure.
+ *
+ * Rays are moved into object space without normalising the direction, so
+ * hit distances are the same in both spaces.
+ */
+class Instance : public Hittable {
+public:
+  Instance(std::shared_ptr<Hittable> object, const Transform &object_to_world)
+      : object(object), object_to_world(object_to_world),
+        world_to_object(object_to_world.inverse()) {}
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   HitRecord &rec) const override {
+    Ray local(world_to_object.point(r.origin()),
+              world_to_object.vector(r.direction()), r.time());
+    if (!object->hit(local, t_min, t_max, rec))
+      return false;
+
+    // The normal already faces the ray, and keeps doing so after the
+    // inverse transpose
+    rec.p = object_to_world.point(rec.p);
+    rec.normal = unit_vector(world_to_object.transpose_vector(rec.normal));
+    return true;
+  }
+
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override {
+    return object->occluded(Ray(world_to_object.point(r.origin()),
+                                world_to_object.vector(r.direction()),
+                                r.time()),
+                            t_min, t_max);
+  }
+
+  virtual bool bounding_box(double time0, double time1,
+                            Aabb &output_box) const override {
+    if (!object->bounding_box(time0, time1, output_box))
+      return false;
+    output_box = object_to_world.box(output_box);
+    return true;
+  }
+
+private:
+  std::shared_ptr<Hittable> object;
+  Transform object_to_world;
+  Transform world_to_object;
+};
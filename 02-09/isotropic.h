@@ -8,8 +8,8 @@ class Isotropic : public Material {
     Isotropic(Color c) : albedo(std::make_shared<SolidColor>(c)) {}
     Isotropic(std::shared_ptr<Texture> a) : albedo(a) {}
 
-    virtual bool scatter(const Ray &r_in, const HitRecord &rec, Color &attenuation, Ray &scattered) const override {
-        scattered = Ray(rec.p, random_in_unit_sphere(), r_in.time());
+    virtual bool scatter(const Ray &r_in, const HitRecord &rec, Color &attenuation, Ray &scattered, Sampler &sampler) const override {
+        scattered = Ray(rec.p, random_in_unit_sphere(sampler), r_in.time());
         attenuation = albedo->value(rec.u, rec.v, rec.p);
         return true;
     }
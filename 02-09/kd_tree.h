@@ -0,0 +1,325 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray.h"
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+struct KdTreeNode {
+  float split;          // interior: plane position along axis
+  std::uint32_t offset; // leaf: first primitive, interior: above child
+  std::uint32_t count;  // primitives in a leaf
+  std::uint8_t axis;    // split axis, 3 for leaves
+  std::uint8_t pad[3];
+
+  bool leaf() const { return axis == 3; }
+};
+
+static_assert(sizeof(KdTreeNode) == 16, "KdTreeNode must be 16 bytes");
+
+/**
+ * A kd-tree: space is cut by axis aligned planes, and every leaf lists the
+ * primitives whose boxes overlap its cell, so a primitive crossing a plane
+ * is referenced from both sides. Cells never overlap, so traversal visits
+ * them strictly front to back along the ray and closest hit queries stop at
+ * the first cell with a hit inside it.
+ *
+ * Planes are chosen with the surface area heuristic over options.bins
+ * candidate positions per axis across the cell, using the traversal and
+ * intersection costs of options. Splits that cut off empty space are made
+ * cheaper, as they let rays skip it. A cell becomes a leaf when it holds
+ * at most options.max_leaf_size primitives, the tree is 8 + 1.3 log2(count)
+ * levels deep, or splitting kept not paying off.
+ *
+ * Nodes are laid out depth first, so the below child of an interior node is
+ * the next node.
+ */
+class KdTree : public Hittable {
+public:
+  KdTree(const HittableList &list, double time0, double time1,
+         const BvhBuildOptions &options = BvhBuildOptions())
+      : KdTree(list.objects, time0, time1, options) {}
+
+  KdTree(const std::vector<std::shared_ptr<Hittable>> &objects, double time0,
+         double time1, const BvhBuildOptions &options = BvhBuildOptions());
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   HitRecord &rec) const override;
+
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
+
+  virtual bool bounding_box(double time0, double time1,
+                            Aabb &output_box) const override {
+    output_box = box;
+    return !nodes.empty();
+  }
+
+  const std::vector<KdTreeNode> &node_array() const { return nodes; }
+  std::size_t reference_count() const { return prims.size(); }
+
+private:
+  static const int max_depth = max_bvh_depth - 1;
+  static constexpr double empty_bonus = 0.5;
+
+  void build_node(const std::vector<Aabb> &boxes,
+                  std::vector<std::uint32_t> refs, const Aabb &bounds,
+                  int depth_left, int bad_refines);
+
+  // Clips the ray to box, returns false if it misses
+  bool clip(const Ray &r, double &t_min, double &t_max) const;
+
+  template <typename Visit>
+  bool walk(const Ray &r, double t_min, double t_max, double &limit,
+            Visit visit) const;
+
+  BvhBuildOptions options;
+  std::vector<KdTreeNode> nodes;
+  std::vector<const Hittable *> prims;
+  std::vector<std::shared_ptr<Hittable>> owned; // keeps prims alive
+  Aabb box;
+};
+
+inline KdTree::KdTree(const std::vector<std::shared_ptr<Hittable>> &objects,
+                      double time0, double time1,
+                      const BvhBuildOptions &options)
+    : options(options), owned(objects) {
+  if (objects.empty())
+    return;
+
+  std::vector<Aabb> boxes(objects.size());
+  std::vector<std::uint32_t> refs(objects.size());
+  box = Aabb::empty();
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    if (!objects[i]->bounding_box(time0, time1, boxes[i])) {
+      std::cerr << "No bounding box in KdTree constructor." << std::endl;
+    }
+    box = surrounding_box(box, boxes[i]);
+    refs[i] = static_cast<std::uint32_t>(i);
+  }
+
+  const auto depth = static_cast<int>(
+      std::round(8 + 1.3 * std::log2(static_cast<double>(objects.size()))));
+  build_node(boxes, std::move(refs), box, std::min(depth, max_depth), 0);
+}
+
+inline void KdTree::build_node(const std::vector<Aabb> &boxes,
+                               std::vector<std::uint32_t> refs,
+                               const Aabb &bounds, int depth_left,
+                               int bad_refines) {
+  const auto index = static_cast<std::uint32_t>(nodes.size());
+  nodes.emplace_back();
+  auto make_leaf = [&] {
+    auto &leaf = nodes[index];
+    leaf.split = 0;
+    leaf.offset = static_cast<std::uint32_t>(prims.size());
+    leaf.count = static_cast<std::uint32_t>(refs.size());
+    leaf.axis = 3;
+    for (auto ref : refs) {
+      prims.push_back(owned[ref].get());
+    }
+  };
+
+  const auto count = refs.size();
+  if (count <= static_cast<std::size_t>(options.max_leaf_size) ||
+      depth_left == 0) {
+    make_leaf();
+    return;
+  }
+
+  // Bin the primitive extents on every axis. A plane between bins b - 1 and
+  // b has the primitives starting before it below and the ones ending after
+  // it above.
+  const int bins = std::max(2, options.bins);
+  const auto area = std::max(bounds.surface_area(), 1e-300);
+  std::vector<std::size_t> starts(bins), ends(bins);
+  auto best_cost = inf;
+  auto best_axis = -1;
+  auto best_split = 0.0;
+  for (int axis = 0; axis < 3; axis++) {
+    const auto lo = bounds.min()[axis];
+    const auto extent = bounds.max()[axis] - lo;
+    if (!(extent > 0))
+      continue;
+    auto bin_of = [&](double x) {
+      auto k = static_cast<int>(bins * ((x - lo) / extent));
+      return std::min(std::max(k, 0), bins - 1);
+    };
+    std::fill(starts.begin(), starts.end(), 0);
+    std::fill(ends.begin(), ends.end(), 0);
+    for (auto ref : refs) {
+      starts[bin_of(boxes[ref].min()[axis])]++;
+      ends[bin_of(boxes[ref].max()[axis])]++;
+    }
+
+    std::size_t below = 0, above = count;
+    for (int b = 1; b < bins; b++) {
+      below += starts[b - 1];
+      above -= ends[b - 1];
+      const auto split = lo + extent * b / bins;
+      auto below_max = bounds.max();
+      auto above_min = bounds.min();
+      below_max[axis] = split;
+      above_min[axis] = split;
+      const auto below_area = Aabb(bounds.min(), below_max).surface_area();
+      const auto above_area = Aabb(above_min, bounds.max()).surface_area();
+      const auto bonus = below == 0 || above == 0 ? empty_bonus : 0.0;
+      const auto cost =
+          options.traversal_cost +
+          options.intersection_cost * (1 - bonus) *
+              (below_area * below + above_area * above) / area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = split;
+      }
+    }
+  }
+
+  const auto leaf_cost = options.intersection_cost * count;
+  if (best_cost > leaf_cost)
+    bad_refines++;
+  if (best_axis < 0 || (best_cost > 4 * leaf_cost && count < 16) ||
+      bad_refines == 3) {
+    make_leaf();
+    return;
+  }
+
+  // Primitives touching the plane go to both sides, so a ray lying in it
+  // finds them whichever side it visits. The plane is stored as a float,
+  // and primitives are sorted against that.
+  best_split = static_cast<float>(best_split);
+  std::vector<std::uint32_t> below, above;
+  for (auto ref : refs) {
+    if (boxes[ref].min()[best_axis] <= best_split)
+      below.push_back(ref);
+    if (boxes[ref].max()[best_axis] >= best_split)
+      above.push_back(ref);
+  }
+  if (below.size() == count && above.size() == count) {
+    make_leaf();
+    return;
+  }
+  refs.clear();
+  refs.shrink_to_fit();
+
+  auto below_max = bounds.max();
+  auto above_min = bounds.min();
+  below_max[best_axis] = best_split;
+  above_min[best_axis] = best_split;
+  nodes[index].split = static_cast<float>(best_split);
+  nodes[index].axis = static_cast<std::uint8_t>(best_axis);
+  nodes[index].count = 0;
+  build_node(boxes, std::move(below), Aabb(bounds.min(), below_max),
+             depth_left - 1, bad_refines);
+  nodes[index].offset = static_cast<std::uint32_t>(nodes.size());
+  build_node(boxes, std::move(above), Aabb(above_min, bounds.max()),
+             depth_left - 1, bad_refines);
+}
+
+inline bool KdTree::clip(const Ray &r, double &t_min, double &t_max) const {
+  for (int a = 0; a < 3; a++) {
+    const auto t0 = (box.min()[a] - r.origin()[a]) * r.invDirection()[a];
+    const auto t1 = (box.max()[a] - r.origin()[a]) * r.invDirection()[a];
+    const auto near = r.getSign(a) ? t1 : t0;
+    const auto far = r.getSign(a) ? t0 : t1;
+    t_min = near > t_min ? near : t_min;
+    t_max = far < t_max ? far : t_max;
+    if (t_max < t_min)
+      return false;
+  }
+  return true;
+}
+
+// Visits the leaves the ray crosses inside [t_min, t_max] front to back, as
+// visit(node, exit) with the distance the ray leaves the leaf's cell. Stops
+// when visit returns true, or at cells starting past limit, which visit may
+// lower.
+template <typename Visit>
+inline bool KdTree::walk(const Ray &r, double t_min, double t_max,
+                         double &limit, Visit visit) const {
+  if (nodes.empty() || !clip(r, t_min, t_max))
+    return false;
+
+  struct Entry {
+    std::uint32_t node;
+    double t_min, t_max;
+  };
+  Entry stack[max_bvh_depth];
+  int top = 0;
+  std::uint32_t current = 0;
+
+  while (true) {
+    if (t_min > limit)
+      return false;
+    const auto &node = nodes[current];
+    if (!node.leaf()) {
+      // The child on the origin's side comes first along the ray
+      const auto a = node.axis;
+      const auto o = r.origin()[a];
+      const auto below_first =
+          o < node.split || (o == node.split && r.direction()[a] <= 0);
+      const auto first = below_first ? current + 1 : node.offset;
+      const auto second = below_first ? node.offset : current + 1;
+      const auto t = (node.split - o) * r.invDirection()[a];
+      if (!(t > 0) || t > t_max) {
+        current = first;
+      } else if (t < t_min) {
+        current = second;
+      } else {
+        stack[top++] = {second, t, t_max};
+        current = first;
+        t_max = t;
+      }
+      continue;
+    }
+
+    if (visit(node, t_max))
+      return true;
+    if (top == 0)
+      return false;
+    --top;
+    current = stack[top].node;
+    t_min = stack[top].t_min;
+    t_max = stack[top].t_max;
+  }
+}
+
+inline bool KdTree::hit(const Ray &r, double t_min, double t_max,
+                        HitRecord &rec) const {
+  // A primitive in several leaves can be hit beyond the current one, so
+  // only hits before the leaf's exit end the walk. t_max also ends it once
+  // the next cell starts past the closest hit so far.
+  bool hit_anything = false;
+  walk(r, t_min, t_max, t_max, [&](const KdTreeNode &leaf, double exit) {
+    for (auto i = leaf.offset; i < leaf.offset + leaf.count; i++) {
+      if (prims[i]->hit(r, t_min, t_max, rec)) {
+        hit_anything = true;
+        t_max = rec.t;
+      }
+    }
+    return hit_anything && t_max <= exit;
+  });
+  return hit_anything;
+}
+
+inline bool KdTree::occluded(const Ray &r, double t_min, double t_max) const {
+  auto limit = t_max;
+  return walk(r, t_min, t_max, limit,
+              [&](const KdTreeNode &leaf, double) {
+                for (auto i = leaf.offset; i < leaf.offset + leaf.count; i++) {
+                  if (prims[i]->occluded(r, t_min, t_max))
+                    return true;
+                }
+                return false;
+              });
+}
@@ -8,12 +8,12 @@ public:
   Lambertian(const Color &a) : albedo(std::make_shared<SolidColor>(a)) {}
   Lambertian(const std::shared_ptr<Texture> a) : albedo(a) {}
 
-  bool scatter(const Ray &r_in, const HitRecord &rec,
-                       Color &attentuation, Ray &scattered) const override {
+  bool scatter(const Ray &r_in, const HitRecord &rec, Color &attentuation,
+               Ray &scattered, Sampler &sampler) const override {
     // lambertian diffuse
-    Vec3 scatter_direction = rec.normal + random_unit_vector();
+    Vec3 scatter_direction = rec.normal + random_unit_vector(sampler);
     // hemispherical scattering
-    // Vec3 scatter_direction = rec.normal + random_in_hemisphere(rec.normal);
+    // Vec3 scatter_direction = rec.normal + random_in_hemisphere(rec.normal, sampler);
     if (scatter_direction.near_zero()) {
       scatter_direction = rec.normal;
     }
@@ -0,0 +1,210 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * A BVH built on demand. At first only the root exists, over the bounds of
+ * every primitive, and a node is split with BvhBuilder the first time a ray
+ * reaches it. Parts of the scene no ray enters are never built, so the
+ * build no longer delays the first pixel, and crops and previews only build
+ * and store the nodes they reach.
+ *
+ * Every node is split exactly once. The splitting thread holds one of a
+ * fixed set of locks, picked by the node's address, and publishes the
+ * children with a release store of the node's state, which traversal reads
+ * with acquire. A node's primitive range is only reordered while it is
+ * split, before any node below it exists, so no ray reads a range while it
+ * moves.
+ *
+ * Nodes are always split with binned SAH whatever options.split is: Lbvh
+ * sorts the whole scene up front, Sbvh copies references between nodes and
+ * the median split draws from the shared random generator.
+ */
+class LazyBvh : public Hittable {
+public:
+  LazyBvh(const HittableList &list, double time0, double time1,
+          const BvhBuildOptions &options)
+      : LazyBvh(list.objects, time0, time1, options) {}
+
+  LazyBvh(const std::vector<std::shared_ptr<Hittable>> &objects, double time0,
+          double time1, const BvhBuildOptions &options);
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   HitRecord &rec) const override;
+
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
+
+  virtual bool bounding_box(double time0, double time1,
+                            Aabb &output_box) const override {
+    output_box = root.bounds;
+    return !owned.empty();
+  }
+
+  // Nodes made so far, the root included
+  std::size_t node_count() const { return built.load(); }
+
+  // Bytes taken by the nodes made so far and the primitive references
+  std::size_t memory_bytes() const {
+    return node_count() * sizeof(Node) + prims.size() * sizeof(BvhPrimitive) +
+           owned.size() * sizeof(std::shared_ptr<Hittable>);
+  }
+
+private:
+  enum State : std::uint8_t { Unsplit, Leaf, Interior };
+
+  struct Node {
+    Aabb bounds;
+    std::uint32_t first = 0;
+    std::uint32_t count = 0;
+    std::uint8_t depth = 0;
+    std::uint8_t axis = 0;
+    std::atomic<std::uint8_t> state{Unsplit};
+    std::unique_ptr<Node[]> children; // two, set before state is Interior
+  };
+
+  static const int max_stack = max_bvh_depth;
+  static const int lock_count = 64;
+
+  // node's children, splitting it first when no ray reached it before, or
+  // null for leaves
+  Node *children(Node &node) const;
+  State split(Node &node) const;
+
+  static BvhBuildOptions sah_options(BvhBuildOptions options) {
+    options.split = BvhSplit::Sah;
+    return options;
+  }
+
+  BvhBuilder builder;
+  mutable Node root;
+  mutable std::vector<BvhPrimitive> prims;
+  std::vector<std::shared_ptr<Hittable>> owned;
+  mutable std::mutex locks[lock_count];
+  mutable std::atomic<std::size_t> built{1};
+};
+
+inline LazyBvh::LazyBvh(const std::vector<std::shared_ptr<Hittable>> &objects,
+                        double time0, double time1,
+                        const BvhBuildOptions &options)
+    : builder(sah_options(options)),
+      prims(bvh_primitives(objects, time0, time1)), owned(objects) {
+  Aabb centroid_bounds;
+  BvhBuilder::range_bounds(prims, 0, prims.size(), root.bounds,
+                           centroid_bounds);
+  root.count = static_cast<std::uint32_t>(prims.size());
+  if (prims.empty())
+    root.state = Leaf;
+}
+
+inline LazyBvh::Node *LazyBvh::children(Node &node) const {
+  auto state = node.state.load(std::memory_order_acquire);
+  if (state == Unsplit) {
+    const auto lock = reinterpret_cast<std::uintptr_t>(&node) / sizeof(Node);
+    std::lock_guard<std::mutex> guard(locks[lock % lock_count]);
+    state = node.state.load(std::memory_order_relaxed);
+    if (state == Unsplit) {
+      state = split(node);
+      node.state.store(state, std::memory_order_release);
+    }
+  }
+  return state == Interior ? node.children.get() : nullptr;
+}
+
+inline LazyBvh::State LazyBvh::split(Node &node) const {
+  static const std::vector<std::uint32_t> no_codes;
+  const std::size_t start = node.first;
+  const std::size_t end = start + node.count;
+
+  Aabb bounds, centroid_bounds;
+  BvhBuilder::range_bounds(prims, start, end, bounds, centroid_bounds);
+  int axis = 0;
+  const auto mid = builder.split_range(prims, no_codes, start, end, bounds,
+                                       centroid_bounds, node.depth, axis);
+  if (mid == end)
+    return Leaf;
+
+  auto children = std::make_unique<Node[]>(2);
+  const std::size_t ranges[3] = {start, mid, end};
+  for (int i = 0; i < 2; i++) {
+    auto &child = children[i];
+    BvhBuilder::range_bounds(prims, ranges[i], ranges[i + 1], child.bounds,
+                             centroid_bounds);
+    child.first = static_cast<std::uint32_t>(ranges[i]);
+    child.count = static_cast<std::uint32_t>(ranges[i + 1] - ranges[i]);
+    child.depth = static_cast<std::uint8_t>(node.depth + 1);
+  }
+  node.axis = static_cast<std::uint8_t>(axis);
+  node.children = std::move(children);
+  built += 2;
+  return Interior;
+}
+
+inline bool LazyBvh::hit(const Ray &r, double t_min, double t_max,
+                         HitRecord &rec) const {
+  Node *stack[max_stack];
+  int top = 0;
+  Node *current = &root;
+  bool hit_anything = false;
+
+  while (true) {
+    if (current->bounds.hit(r, t_min, t_max)) {
+      if (auto child = children(*current)) {
+        // Nearer child first, by the sign of the ray along the split axis
+        const auto near = r.getSign(current->axis);
+        stack[top++] = &child[1 - near];
+        current = &child[near];
+        continue;
+      }
+      for (auto i = current->first; i < current->first + current->count;
+           i++) {
+        if (owned[prims[i].index]->hit(r, t_min, t_max, rec)) {
+          hit_anything = true;
+          t_max = rec.t;
+        }
+      }
+    }
+    if (top == 0)
+      break;
+    current = stack[--top];
+  }
+
+  return hit_anything;
+}
+
+inline bool LazyBvh::occluded(const Ray &r, double t_min,
+                              double t_max) const {
+  // The same walk as hit, returning at the first primitive hit
+  Node *stack[max_stack];
+  int top = 0;
+  Node *current = &root;
+
+  while (true) {
+    if (current->bounds.hit(r, t_min, t_max)) {
+      if (auto child = children(*current)) {
+        const auto near = r.getSign(current->axis);
+        stack[top++] = &child[1 - near];
+        current = &child[near];
+        continue;
+      }
+      for (auto i = current->first; i < current->first + current->count;
+           i++) {
+        if (owned[prims[i].index]->occluded(r, t_min, t_max))
+          return true;
+      }
+    }
+    if (top == 0)
+      return false;
+    current = stack[--top];
+  }
+}
@@ -7,7 +7,8 @@ public:
   Light(const Color &a) : albedo(a) {}
 
   virtual bool scatter(const Ray &r_in, const HitRecord &rec,
-                       Color &attentuation, Ray &scattered) const override {
+                       Color &attentuation, Ray &scattered,
+                       Sampler &sampler) const override {
     attentuation = albedo;
     return false;
   }
@@ -0,0 +1,220 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray.h"
+#include "rtweekend.h"
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// Bounds stored as floats, rounded outwards so they still contain the
+// double precision box
+struct alignas(32) LinearBvhNode {
+  float min[3];
+  float max[3];
+  std::uint32_t offset; // leaf: first primitive, interior: second child
+  std::uint16_t count;  // primitives in a leaf, 0 for interior nodes
+  std::uint8_t axis;    // split axis of interior nodes
+  std::uint8_t pad;
+
+  bool leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(LinearBvhNode) == 32, "LinearBvhNode must be 32 bytes");
+
+inline float round_down(double x) {
+  auto f = static_cast<float>(x);
+  return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity())
+               : f;
+}
+
+inline float round_up(double x) {
+  auto f = static_cast<float>(x);
+  return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Slab test of a ray against float bounds
+inline bool hit_bounds(const float min[3], const float max[3], const Ray &r,
+                       double tmin, double tmax) {
+  for (int a = 0; a < 3; a++) {
+    const double lo = r.getSign(a) ? max[a] : min[a];
+    const double hi = r.getSign(a) ? min[a] : max[a];
+    const auto t0 = (lo - r.origin()[a]) * r.invDirection()[a];
+    const auto t1 = (hi - r.origin()[a]) * r.invDirection()[a];
+    tmin = t0 > tmin ? t0 : tmin;
+    tmax = t1 < tmax ? t1 : tmax;
+    if (tmax < tmin)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * A BVH compiled into one contiguous array of 32 byte nodes.
+ *
+ * Nodes are laid out depth first, so the first child of an interior node is
+ * the next node and only the second child needs an index. Leaves index a
+ * range of the primitive array. Traversal uses an explicit stack instead of
+ * recursion and a virtual call per node, and visits the child on the near
+ * side of the split plane (by the sign of the ray direction) first so the
+ * closest hit shrinks t_max early.
+ */
+class LinearBvh : public Hittable {
+public:
+  LinearBvh(const HittableList &list, double time0, double time1,
+            const BvhBuildOptions &options)
+      : LinearBvh(BvhBuilder(options).build(
+                      bvh_primitives(list.objects, time0, time1)),
+                  list.objects) {}
+
+  LinearBvh(const BvhBuild &build,
+            const std::vector<std::shared_ptr<Hittable>> &objects);
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   HitRecord &rec) const override;
+
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
+
+  virtual bool bounding_box(double time0, double time1,
+                            Aabb &output_box) const override {
+    output_box = box;
+    return !nodes.empty();
+  }
+
+  const std::vector<LinearBvhNode> &node_array() const { return nodes; }
+
+private:
+  static const int max_stack = max_bvh_depth;
+
+  std::uint32_t flatten(const BvhBuild &build, std::uint32_t node);
+
+  std::vector<LinearBvhNode> nodes;
+  std::vector<const Hittable *> prims;
+  std::vector<std::shared_ptr<Hittable>> owned; // keeps prims alive
+  Aabb box;
+};
+
+inline LinearBvh::LinearBvh(
+    const BvhBuild &build,
+    const std::vector<std::shared_ptr<Hittable>> &objects) {
+  owned.reserve(build.prims.size());
+  prims.reserve(build.prims.size());
+  for (const auto &prim : build.prims) {
+    owned.push_back(objects[prim.index]);
+    prims.push_back(owned.back().get());
+  }
+
+  if (build.nodes.empty())
+    return;
+  box = build.nodes[0].bounds;
+  nodes.reserve(build.nodes.size());
+  flatten(build, 0);
+}
+
+inline std::uint32_t LinearBvh::flatten(const BvhBuild &build,
+                                        std::uint32_t node) {
+  const auto &n = build.nodes[node];
+  const auto index = static_cast<std::uint32_t>(nodes.size());
+  nodes.emplace_back();
+
+  auto &out = nodes[index];
+  for (int a = 0; a < 3; a++) {
+    out.min[a] = round_down(n.bounds.min()[a]);
+    out.max[a] = round_up(n.bounds.max()[a]);
+  }
+  out.axis = static_cast<std::uint8_t>(n.axis);
+  out.pad = 0;
+
+  if (n.leaf()) {
+    out.offset = n.first;
+    out.count = static_cast<std::uint16_t>(n.count);
+    return index;
+  }
+
+  out.count = 0;
+  flatten(build, n.child[0]);
+  auto second = flatten(build, n.child[1]);
+  nodes[index].offset = second; // out may have moved
+  return index;
+}
+
+inline bool LinearBvh::hit(const Ray &r, double t_min, double t_max,
+                           HitRecord &rec) const {
+  if (nodes.empty())
+    return false;
+
+  std::uint32_t stack[max_stack];
+  int top = 0;
+  std::uint32_t current = 0;
+  bool hit_anything = false;
+
+  while (true) {
+    const auto &node = nodes[current];
+    if (hit_bounds(node.min, node.max, r, t_min, t_max)) {
+      if (node.leaf()) {
+        for (auto i = node.offset; i < node.offset + node.count; i++) {
+          if (prims[i]->hit(r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+          }
+        }
+      } else if (r.getSign(node.axis)) {
+        // Ray travels towards -axis, the second child is nearer
+        stack[top++] = current + 1;
+        current = node.offset;
+        continue;
+      } else {
+        stack[top++] = node.offset;
+        current = current + 1;
+        continue;
+      }
+    }
+    if (top == 0)
+      break;
+    current = stack[--top];
+  }
+
+  return hit_anything;
+}
+
+inline bool LinearBvh::occluded(const Ray &r, double t_min,
+                                double t_max) const {
+  if (nodes.empty())
+    return false;
+
+  // The same walk as hit, returning at the first primitive hit
+  std::uint32_t stack[max_stack];
+  int top = 0;
+  std::uint32_t current = 0;
+
+  while (true) {
+    const auto &node = nodes[current];
+    if (hit_bounds(node.min, node.max, r, t_min, t_max)) {
+      if (node.leaf()) {
+        for (auto i = node.offset; i < node.offset + node.count; i++) {
+          if (prims[i]->occluded(r, t_min, t_max))
+            return true;
+        }
+      } else if (r.getSign(node.axis)) {
+        stack[top++] = current + 1;
+        current = node.offset;
+        continue;
+      } else {
+        stack[top++] = node.offset;
+        current = current + 1;
+        continue;
+      }
+    }
+    if (top == 0)
+      return false;
+    current = stack[--top];
+  }
+}
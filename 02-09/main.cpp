@@ -1,57 +1,101 @@
 #include "aarect.h"
 #include "box.h"
+#include "accelerator.h"
 #include "bvh.h"
+#include "bvh_benchmark.h"
+#include "bvh_build.h"
+#include "bvh_cache.h"
+#include "bvh_stats.h"
 #include "camera.h"
+#include "checkpoint.h"
 #include "checker_texture.h"
 #include "color.h"
 #include "dielectric.h"
 #include "diffuse_light.h"
+#include "film.h"
 #include "hittable_list.h"
 #include "image_texture.h"
+#include "instance.h"
 #include "lambertian.h"
 #include "light.h"
 #include "material.h"
 #include "metal.h"
 #include "noise_texture.h"
+#include "options.h"
+#include "pixel_stats.h"
+#include "progress.h"
+#include "renderer.h"
 #include "rtweekend.h"
+#include "sampler.h"
 #include "sphere.h"
+#include "transform.h"
 #include "constant_medium.h"
 
 #include "../external/lodepng/lodepng.h"
 #include "vec3.h"
+#include "wavefront.h"
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <csignal>
 #include <cstdio>
-#include <execution>
+#include <functional>
 #include <iostream>
 #include <memory>
-#include <mutex>
-#include <numeric>
+#include <random>
 
 #define FILE_NAME "out.png"
+#define SPP_FILE_NAME "spp.png"
 
+// Set by SIGINT/SIGTERM, the render stops and checkpoints after the pass
+volatile std::sig_atomic_t stop_requested = 0;
+
+void request_stop(int) { stop_requested = 1; }
+
+/**
+ * Traces one path iteratively, carrying the path throughput instead of
+ * recursing once per bounce.
+ * After roulette_depth bounces a path survives each bounce with a probability
+ * equal to its largest throughput component and is reweighted when it does,
+ * so paths that can no longer contribute much stop early without biasing the
+ * image.
+ */
 Color ray_color(const Ray &r, const Color &background, const Hittable &world,
-                int depth) {
+                int max_depth, int roulette_depth, Sampler &sampler) {
+  Color radiance(0, 0, 0);
+  Color throughput(1, 1, 1);
+  Ray ray = r;
   HitRecord rec;
 
-  // Stop recursion
-  if (depth <= 0) {
-    return Color(0, 0, 0);
-  }
-  if (!world.hit(r, 0.001, inf, rec)) {
-    return background;
-  }
-  Ray scattered;
-  Color attenuation;
-  Color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+  for (int depth = 0; depth < max_depth; depth++) {
+    sampler.next_bounce();
+    if (!world.hit(ray, 0.001, inf, rec)) {
+      radiance += throughput * background;
+      break;
+    }
 
-  if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
-    return emitted;
+    Ray scattered;
+    Color attenuation;
+    radiance += throughput * rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    if (!rec.mat_ptr->scatter(ray, rec, attenuation, scattered, sampler)) {
+      break;
+    }
+    throughput = throughput * attenuation;
+
+    if (depth >= roulette_depth) {
+      auto survive = std::min(
+          0.95, std::max({throughput.x(), throughput.y(), throughput.z()}));
+      if (sampler.random_double() >= survive) {
+        break;
+      }
+      throughput /= survive;
+    }
+    ray = scattered;
   }
-  return emitted +
-         attenuation * ray_color(scattered, background, world, depth - 1);
+
+  return radiance;
 }
 
 void write_color(Image &img, int x, int y, Color pixel_color) {
@@ -63,6 +107,26 @@ void write_color(Image &img, int x, int y, Color pixel_color) {
   img.set({x, img.height - y - 1}, Color(r, g, b));
 }
 
+// Writes the developed film and a map of the samples each pixel used
+void save_film(const Film &film, int max_samples) {
+  Image img(film.width, film.height);
+  Image spp_map(film.width, film.height);
+
+  for (std::size_t y = 0; y < film.height; ++y) {
+    for (std::size_t x = 0; x < film.width; ++x) {
+      const auto &stats = film.at(x, y);
+      write_color(img, x, y, stats.mean());
+
+      auto used = static_cast<double>(stats.samples()) / max_samples;
+      spp_map.set({x, film.height - y - 1}, Color(used, used, used));
+    }
+  }
+
+  lodepng::encode(FILE_NAME, img.data(), film.width, film.height, LCT_RGB);
+  lodepng::encode(SPP_FILE_NAME, spp_map.data(), film.width, film.height,
+                  LCT_RGB);
+}
+
 HittableList random_scene() {
   HittableList world;
 
@@ -117,6 +181,43 @@ HittableList random_scene() {
   return world;
 }
 
+// count small spheres scattered through a cube, for timing BVH builds.
+// With motion > 0 each sphere moves up to motion radii along every axis
+// between times 0 and 1.
+HittableList sphere_field(int count, double motion = 0) {
+  HittableList world;
+  auto material = std::make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+  const double size = 1000;
+  const double radius = 0.5 * size / std::cbrt(count);
+  for (int i = 0; i < count; i++) {
+    auto center = Point3::random(0, size);
+    auto center2 = center;
+    if (motion > 0) {
+      center2 += motion * radius * Vec3::random(-1, 1);
+    }
+    world.add(std::make_shared<Sphere>(center, center2, 0.0, 1.0, radius,
+                                       material));
+  }
+  return world;
+}
+
+// count small spheres with boards long enough to cross the whole cube, one
+// for every hundred spheres. Each board overlaps many spheres, the case
+// spatial splits are for.
+HittableList board_field(int count) {
+  auto world = sphere_field(count);
+  auto material = std::make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+  const double size = 1000;
+  const double half_width = 2.5 * size / std::cbrt(count);
+  for (int i = 0; i < count / 100; i++) {
+    auto center = Point3::random(0, size);
+    Vec3 half(half_width, half_width, half_width);
+    half[i % 3] = 0.5 * size;
+    world.add(std::make_shared<Box>(center - half, center + half, material));
+  }
+  return world;
+}
+
 HittableList two_perlin_spheres() {
   HittableList objects;
 
@@ -216,7 +317,8 @@ HittableList cornell_smoke() {
   return objects;
 }
 
-HittableList final_scene() {
+// The 20x20 field of ground boxes in final_scene
+HittableList final_scene_ground() {
     HittableList boxes1;
     auto ground = std::make_shared<Lambertian>(Color(0.48,0.83,0.53));
 
@@ -235,8 +337,52 @@ HittableList final_scene() {
         }
     }
 
+    return boxes1;
+}
+
+// The cube of 1000 spheres in final_scene
+HittableList final_scene_cluster() {
+    HittableList boxes2;
+    auto white = std::make_shared<Lambertian>(Color(0.73,0.73,0.73));
+    int ns = 1000;
+    for (int j = 0; j < ns; j++) {
+        boxes2.add(std::make_shared<Sphere>(Point3::random(0,165), 10, white));
+    }
+
+    return boxes2;
+}
+
+// count copies of the final_scene sphere cluster on a grid. The cluster's
+// BVH is built once and every copy is an Instance of it.
+HittableList instanced_clusters(const AcceleratorOptions &accel, int count) {
+  HittableList world;
+  auto cluster = make_accelerator(final_scene_cluster(), 0.0, 1.0, accel);
+  const int side = static_cast<int>(std::ceil(std::sqrt(count)));
+  for (int i = 0; i < count; i++) {
+    auto offset = Vec3(200.0 * (i % side), 0, 200.0 * (i / side));
+    world.add(std::make_shared<Instance>(
+        cluster, Transform::translate(offset) *
+                     Transform::rotate_y(random_double(0, 360)) *
+                     Transform::scale(Vec3(1, 1, 1) * random_double(0.5, 1))));
+  }
+  return world;
+}
+
+// A hierarchy built inside a scene, over objects in its own space
+struct SceneSubtree {
+  const char *name;
+  HittableList objects;
+  std::shared_ptr<Hittable> accelerator;
+  Transform to_world;
+};
+
+// Also lists the ground and cluster hierarchies in subtrees, when given
+HittableList final_scene(const AcceleratorOptions &accel,
+                         std::vector<SceneSubtree> *subtrees = nullptr) {
     HittableList objects;
-    objects.add(std::make_shared<BvhNode>(boxes1, 0, 1));
+    auto ground_objects = final_scene_ground();
+    auto ground = make_accelerator(ground_objects, 0, 1, accel);
+    objects.add(ground);
 
     auto light = std::make_shared<DiffuseLight>(Color(7,7,7));
     objects.add(std::make_shared<xzRect>(123,423,149,412,554,light));
@@ -260,26 +406,276 @@ HittableList final_scene() {
     auto pertext = std::make_shared<NoiseTexture>(0.1);
     objects.add(std::make_shared<Sphere>(Point3(220,280,300), 80, std::make_shared<Lambertian>(pertext)));
 
-    HittableList boxes2;
-    auto white = std::make_shared<Lambertian>(Color(0.73,0.73,0.73));
-    int ns = 1000;
-    for (int j = 0; j < ns; j++) {
-        boxes2.add(std::make_shared<Sphere>(Point3::random(0,165), 10, white));
+    auto cluster_objects = final_scene_cluster();
+    auto cluster = make_accelerator(cluster_objects, 0.0, 1.0, accel);
+    const auto cluster_to_world = Transform::translate(Vec3(-100, 270, 395)) * Transform::rotate_y(15);
+    objects.add(std::make_shared<Instance>(cluster, cluster_to_world));
+
+    if (subtrees) {
+        subtrees->push_back({"ground", ground_objects, ground, Transform()});
+        subtrees->push_back({"cluster", cluster_objects, cluster, cluster_to_world});
     }
+    return objects;
+}
 
-    objects.add(std::make_shared<Translate>(std::make_shared<rotateY>(std::make_shared<BvhNode>(boxes2, 0.0, 1.0), 15), Vec3(-100, 270, 395)));
+// Compares the BVH builders and layouts on the same scenes and prints a table
+void run_bvh_benchmark(double time0, double time1) {
+  AcceleratorOptions median;
+  median.type = Accelerator::BvhTree;
+  median.bvh.split = BvhSplit::Median;
+  median.bvh.max_leaf_size = 1;
+  AcceleratorOptions sah;
+  sah.type = Accelerator::BvhTree;
+  AcceleratorOptions sah_linear;
+  sah_linear.type = Accelerator::BvhLinear;
+  AcceleratorOptions sah_bvh4;
+  sah_bvh4.type = Accelerator::Bvh4;
+  AcceleratorOptions sah_bvh8;
+  sah_bvh8.type = Accelerator::Bvh8;
+  AcceleratorOptions lbvh_bvh8;
+  lbvh_bvh8.type = Accelerator::Bvh8;
+  lbvh_bvh8.bvh.split = BvhSplit::Lbvh;
+  AcceleratorOptions sah_motion;
+  sah_motion.type = Accelerator::BvhMotion;
+  AcceleratorOptions sah_quantized;
+  sah_quantized.type = Accelerator::BvhQuantized;
 
-    return objects;
+  struct Scene {
+    const char *name;
+    std::function<HittableList(const AcceleratorOptions &)> make;
+  };
+  const Scene scenes[] = {
+      {"final_scene",
+       [](const AcceleratorOptions &accel) { return final_scene(accel); }},
+      {"final_scene ground",
+       [](const AcceleratorOptions &) { return final_scene_ground(); }},
+      {"final_scene cluster",
+       [](const AcceleratorOptions &) { return final_scene_cluster(); }},
+      {"random_scene", [](const AcceleratorOptions &) { return random_scene(); }},
+      {"sphere_field 1M",
+       [](const AcceleratorOptions &) { return sphere_field(1000000); }},
+      {"moving field 100k",
+       [](const AcceleratorOptions &) { return sphere_field(100000, 10); }},
+      {"instanced 1M",
+       [](const AcceleratorOptions &accel) {
+         return instanced_clusters(accel, 1000);
+       }},
+      {"board_field 20k",
+       [](const AcceleratorOptions &) { return board_field(20000); }},
+  };
+  const std::size_t ray_count = 200000;
+  const int builder_count = 8;
+  const AcceleratorOptions *builders[builder_count] = {
+      &median,    &sah,       &sah_linear, &sah_bvh4,
+      &sah_bvh8,  &lbvh_bvh8, &sah_motion, &sah_quantized};
+  const char *builder_names[builder_count] = {
+      "median", "sah",    "sah-lin", "sah-4",
+      "sah-8",  "lbvh-8", "sah-mot", "sah-8q"};
+
+  std::cout << "scene                 builder  build_ms  sah_cost  ns_per_ray"
+               "  hit_fraction  ns_occluded\n";
+  for (const auto &scene : scenes) {
+    std::vector<Ray> rays;
+    BvhBenchmark results[builder_count];
+
+    for (int b = 0; b < builder_count; b++) {
+      // Same seed, same scene for every builder
+      random_generator().seed(std::mt19937::default_seed);
+      auto objects = scene.make(*builders[b]);
+      if (rays.empty()) {
+        Aabb bounds;
+        objects.bounding_box(time0, time1, bounds);
+        rays = benchmark_rays(bounds, ray_count, time0, time1);
+      }
+      random_generator().seed(std::mt19937::default_seed);
+      results[b] = benchmark_bvh(objects, *builders[b], rays, time0, time1);
+
+      std::printf("%-21s %-7s %9.2f %9.2f %11.1f %13.3f %12.1f\n",
+                  scene.name, builder_names[b], results[b].build_ms,
+                  results[b].sah_cost, results[b].ns_per_ray,
+                  results[b].hit_fraction, results[b].ns_per_occluded);
+    }
+    std::printf("%-21s sah/median: sah_cost x%.2f, ns_per_ray x%.2f\n",
+                scene.name, results[1].sah_cost / results[0].sah_cost,
+                results[1].ns_per_ray / results[0].ns_per_ray);
+    std::printf("%-21s ns_per_ray vs tree: linear x%.2f, bvh4 x%.2f, "
+                "bvh8 x%.2f\n",
+                scene.name, results[2].ns_per_ray / results[1].ns_per_ray,
+                results[3].ns_per_ray / results[1].ns_per_ray,
+                results[4].ns_per_ray / results[1].ns_per_ray);
+    std::printf("%-21s lbvh/sah with bvh8: build_ms x%.2f, ns_per_ray x%.2f\n",
+                scene.name, results[5].build_ms / results[4].build_ms,
+                results[5].ns_per_ray / results[4].ns_per_ray);
+    std::printf("%-21s motion/linear: ns_per_ray x%.2f\n", scene.name,
+                results[6].ns_per_ray / results[2].ns_per_ray);
+    std::printf("%-21s quantized/bvh8: ns_per_ray x%.2f\n", scene.name,
+                results[7].ns_per_ray / results[4].ns_per_ray);
+  }
+
+  // Spatial splits against plain SAH where large primitives overlap small
+  // ones, in traversal work per ray
+  AcceleratorOptions sbvh_bvh8;
+  sbvh_bvh8.type = Accelerator::Bvh8;
+  sbvh_bvh8.bvh.split = BvhSplit::Sbvh;
+  const AcceleratorOptions *split_builders[2] = {&sah_bvh8, &sbvh_bvh8};
+  std::cout << "\nscene                 builder  references  sah_cost  "
+               "nodes_per_ray  prims_per_ray  ns_per_ray\n";
+  for (int s : {0, 1, 2, 3, 7}) {
+    const auto &scene = scenes[s];
+    std::vector<Ray> rays;
+    BvhStats stats[2];
+    BvhBenchmark results[2];
+    for (int b = 0; b < 2; b++) {
+      const auto &options = *split_builders[b];
+      random_generator().seed(std::mt19937::default_seed);
+      auto objects = scene.make(options);
+      if (rays.empty()) {
+        Aabb bounds;
+        objects.bounding_box(time0, time1, bounds);
+        rays = benchmark_rays(bounds, ray_count, time0, time1);
+      }
+      auto build = BvhBuilder(options.bvh).build(
+          bvh_primitives(objects.objects, time0, time1));
+      stats[b] = bvh_stats(build, options.bvh, objects.objects, rays);
+      results[b] = benchmark_bvh(objects, options, rays, time0, time1);
+      std::printf("%-21s %-7s %11zu %9.2f %14.1f %14.2f %11.1f\n",
+                  scene.name, bvh_split_name(options.bvh.split),
+                  stats[b].primitives, stats[b].sah_cost,
+                  stats[b].nodes_per_ray, stats[b].primitives_per_ray,
+                  results[b].ns_per_ray);
+    }
+    std::printf("%-21s sbvh/sah: nodes_per_ray x%.2f, prims_per_ray x%.2f, "
+                "ns_per_ray x%.2f\n",
+                scene.name, stats[1].nodes_per_ray / stats[0].nodes_per_ray,
+                stats[1].primitives_per_ray / stats[0].primitives_per_ray,
+                results[1].ns_per_ray / results[0].ns_per_ray);
+  }
+
+  // The BVH against a uniform grid and a kd-tree. final_scene ground and
+  // cluster are the subtrees final_scene builds separately, so their
+  // winners are the accelerators to use for them.
+  AcceleratorOptions sah_grid;
+  sah_grid.type = Accelerator::Grid;
+  const std::vector<Accelerator> types = {Accelerator::Bvh8, Accelerator::Grid,
+                                          Accelerator::KdTree};
+  std::cout << "\nscene                 bvh8_ms  grid_ms  kdtree_ms  bvh8_ns  "
+               "grid_ns  kdtree_ns  fastest\n";
+  for (int s : {0, 1, 2, 3, 4, 7}) {
+    const auto &scene = scenes[s];
+    random_generator().seed(std::mt19937::default_seed);
+    auto objects = scene.make(sah_bvh8);
+    Aabb bounds;
+    objects.bounding_box(time0, time1, bounds);
+    auto rays = benchmark_rays(bounds, ray_count, time0, time1);
+    std::vector<BvhBenchmark> results;
+    auto fastest = fastest_accelerator(objects, sah_grid, types, rays, time0,
+                                       time1, &results);
+    std::printf("%-21s %7.1f %8.1f %10.1f %8.1f %8.1f %10.1f  %s\n",
+                scene.name, results[0].build_ms, results[1].build_ms,
+                results[2].build_ms, results[0].ns_per_ray,
+                results[1].ns_per_ray, results[2].ns_per_ray,
+                accelerator_name(fastest));
+  }
+
+  // Lazy against full builds, for every ray and for a crop: the same ray
+  // origins aimed into the middle tenth of the scene along each axis
+  std::cout << "\nscene                 rays  eager_first_ms  lazy_first_ms  "
+               "eager_ns  lazy_ns  eager_nodes  lazy_nodes\n";
+  for (int s : {4, 7}) {
+    const auto &scene = scenes[s];
+    random_generator().seed(std::mt19937::default_seed);
+    auto objects = scene.make(sah_bvh8);
+    Aabb bounds;
+    objects.bounding_box(time0, time1, bounds);
+    auto rays = benchmark_rays(bounds, ray_count, time0, time1);
+    auto crop = rays;
+    const auto center = bounds.centroid();
+    const auto extent = 0.05 * (bounds.max() - bounds.min());
+    for (std::size_t i = 0; i < crop.size(); i++) {
+      Sampler sampler(i, 1);
+      auto target = center + Vec3(extent.x() * sampler.random_double(-1, 1),
+                                  extent.y() * sampler.random_double(-1, 1),
+                                  extent.z() * sampler.random_double(-1, 1));
+      crop[i] = Ray(rays[i].origin(), target - rays[i].origin(),
+                    rays[i].time());
+    }
+    const std::vector<Ray> *ray_sets[2] = {&rays, &crop};
+    const char *ray_set_names[2] = {"all", "crop"};
+    for (int r = 0; r < 2; r++) {
+      auto result =
+          benchmark_lazy(objects, sah_bvh8, *ray_sets[r], time0, time1);
+      std::printf("%-21s %-4s %15.1f %14.1f %9.1f %8.1f %12zu %11zu\n",
+                  scene.name, ray_set_names[r], result.eager_first_ms,
+                  result.lazy_first_ms, result.eager_ns_per_ray,
+                  result.lazy_ns_per_ray, result.eager_nodes,
+                  result.lazy_nodes);
+    }
+  }
+
+  // 2% of the spheres move each frame, drifting until a rebuild is due
+  random_generator().seed(std::mt19937::default_seed);
+  auto field = sphere_field(100000);
+  std::cout << "\nrefit sphere_field 100k with bvh8, 2% moving per frame\n"
+               "frame  update_ms  rebuild_ms  sah_cost  rebuilt\n";
+  auto frames = benchmark_refit(field, sah_bvh8, 20, 0.02, 50, time0, time1);
+  for (std::size_t f = 0; f < frames.size(); f++) {
+    std::printf("%5zu %10.2f %11.2f %9.2f  %s\n", f + 1, frames[f].update_ms,
+                frames[f].rebuild_ms, frames[f].sah_cost,
+                frames[f].rebuilt ? "yes" : "no");
+  }
 }
 
 int main(int argc, char *argv[]) {
+  // The time budget covers the whole run, scene and BVH build included
+  const auto program_start = std::chrono::high_resolution_clock::now();
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (options.bvh_benchmark) {
+    run_bvh_benchmark(0.0, 1.0);
+    return EXIT_SUCCESS;
+  }
+
+  AcceleratorOptions accel;
+  accel.type = options.accelerator;
+  accel.bvh.split = options.bvh_split;
+  // The median builder reproduces the original one primitive per leaf trees
+  accel.bvh.max_leaf_size =
+      accel.bvh.split == BvhSplit::Median ? 1 : options.bvh_leaf_size;
+  accel.cache_dir = options.bvh_cache;
+
+  // Shutter
+  const double time0 = 0.0;
+  const double time1 = 0.5;
+
   // World
-  // auto world = BvhNode(random_scene(), time0, time1);
+  // auto world_ptr = make_accelerator(random_scene(), time0, time1, accel);
+  // auto world_ptr =
+  //     make_accelerator(instanced_clusters(accel, 1000), time0, time1, accel);
   // auto world = two_perlin_spheres();
   // auto world = earth();
   // auto world = simple_light();
   // auto world = cornell_smoke();
-  auto world = final_scene();
+  auto build_start = std::chrono::high_resolution_clock::now();
+  std::vector<SceneSubtree> subtrees;
+  auto scene = final_scene(accel, &subtrees);
+  BvhBuild world_build;
+  std::shared_ptr<Hittable> world_ptr;
+  if (uses_bvh_build(accel.type)) {
+    world_build = cached_bvh_build(bvh_primitives(scene.objects, time0, time1),
+                                   accel.bvh, accel.cache_dir);
+    world_ptr =
+        make_accelerator(world_build, scene.objects, time0, time1, accel);
+  } else {
+    world_ptr = make_accelerator(scene, time0, time1, accel);
+  }
+  const Hittable &world = *world_ptr;
+  std::chrono::duration<double, std::milli> build_time =
+      std::chrono::high_resolution_clock::now() - build_start;
+  std::cerr << "BVH build: " << build_time.count() << " ms" << std::endl;
 
   // Image
   const auto aspect_ratio = 1.0;
@@ -287,8 +683,23 @@ int main(int argc, char *argv[]) {
   const unsigned image_height = static_cast<int>(image_width / aspect_ratio);
   const int samples_per_pixel = 10000;
   const int max_depth = 50;
-  const double time0 = 0.0;
-  const double time1 = 0.5;
+  const int roulette_depth = 3;
+
+  // Adaptive sampling
+  // The render traces samples_per_pixel samples per pixel on average. Pixels
+  // stop once the relative error of their luminance drops below
+  // max_relative_error, checked after every pass once a pixel has
+  // min_samples, and the samples they leave go to the pixels still noisy,
+  // up to max_samples each. Without adaptive sampling every pixel gets
+  // samples_per_pixel.
+  const bool adaptive = options.adaptive;
+  const int min_samples = options.min_samples;
+  const int max_samples = !adaptive                  ? samples_per_pixel
+                          : options.max_samples > 0 ? options.max_samples
+                                                    : 4 * samples_per_pixel;
+  const double max_relative_error = options.max_relative_error;
+  const auto sample_budget = static_cast<unsigned long long>(image_width) *
+                             image_height * samples_per_pixel;
 
   // Camera
   Color background(0, 0, 0);
@@ -301,38 +712,332 @@ int main(int argc, char *argv[]) {
   Camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus,
              time0, time1);
 
+  if (options.bvh_stats) {
+    // One camera ray through a random point of every cell of a grid
+    const int grid = 128;
+    std::vector<Ray> rays;
+    for (int j = 0; j < grid; j++) {
+      for (int i = 0; i < grid; i++) {
+        Sampler sampler(j * grid + i, 0);
+        auto s = (i + sampler.random_double()) / grid;
+        auto t = (j + sampler.random_double()) / grid;
+        rays.push_back(cam.get_ray(s, t, sampler));
+      }
+    }
+    // One record per hierarchy the scene builds, the nested ones first, with
+    // the camera rays taken into each one's space. Traversal counts are for
+    // a BVH over the same objects whatever the layout.
+    for (const auto &subtree : subtrees) {
+      const auto to_object = subtree.to_world.inverse();
+      std::vector<Ray> local;
+      for (const auto &r : rays) {
+        local.emplace_back(to_object.point(r.origin()),
+                           to_object.vector(r.direction()), r.time());
+      }
+      const auto &objects = subtree.objects.objects;
+      const auto build = BvhBuilder(accel.bvh).build(
+          bvh_primitives(objects, time0, time1));
+      auto stats = bvh_stats(build, accel.bvh, objects, local);
+      stats.memory_bytes =
+          accelerator_bytes(*subtree.accelerator, build, accel.type);
+      print_bvh_stats_json(std::cout, subtree.name, stats, accel);
+    }
+    if (!uses_bvh_build(accel.type)) {
+      world_build = BvhBuilder(accel.bvh).build(
+          bvh_primitives(scene.objects, time0, time1));
+    }
+    auto stats = bvh_stats(world_build, accel.bvh, scene.objects, rays);
+    stats.memory_bytes = accelerator_bytes(world, world_build, accel.type);
+    print_bvh_stats_json(std::cout, "top", stats, accel);
+    return EXIT_SUCCESS;
+  }
+
   // Render
-  Image img(image_width, image_height);
-  std::vector<int> ys(image_height);
-  std::iota(ys.begin(), ys.end(), 0);
-  int lines(0);
-  std::mutex lines_mutex;
+  // The image is built up in passes of samples_per_pass samples over every
+  // pixel that still needs them. A snapshot is written every snapshot_passes
+  // passes or snapshot_interval seconds, whichever comes first.
+  // With a time budget the first pass is a single sample used to measure the
+  // sample rate. Later passes shrink to what still fits before the deadline
+  // so every pixel in a pass gets the same samples and the image is never
+  // left half rendered.
+  const int samples_per_pass = 16;
+  const int snapshot_passes = 16;
+  const double snapshot_interval = 300.0;
+
+  // Resuming needs the same scene and settings. The scene stands in by the
+  // bounds of its top level objects.
+  CheckpointFingerprint fingerprint;
+  for (const auto &prim : bvh_primitives(scene.objects, time0, time1)) {
+    fingerprint.add_vec(prim.bounds.min());
+    fingerprint.add_vec(prim.bounds.max());
+  }
+  fingerprint.add(image_width);
+  fingerprint.add(image_height);
+  fingerprint.add(samples_per_pixel);
+  fingerprint.add(max_depth);
+  fingerprint.add(roulette_depth);
+  fingerprint.add(adaptive);
+  fingerprint.add(min_samples);
+  fingerprint.add(max_samples);
+  fingerprint.add_double(max_relative_error);
+  fingerprint.add(samples_per_pass);
+  fingerprint.add(static_cast<std::uint64_t>(options.integrator));
+  fingerprint.add_vec(background);
+  fingerprint.add_vec(lookfrom);
+  fingerprint.add_vec(lookat);
+  fingerprint.add_vec(vup);
+  fingerprint.add_double(vfov);
+  fingerprint.add_double(dist_to_focus);
+  fingerprint.add_double(aperture);
+  fingerprint.add_double(time0);
+  fingerprint.add_double(time1);
+
+  Film film(image_width, image_height);
+  Renderer renderer(image_width, image_height, options.tile_size,
+                    options.tile_order);
+  const auto tile_count = renderer.tiles().size();
+  Wavefront wavefront(cam, world, background, image_width, image_height,
+                      max_depth, roulette_depth);
+  Progress progress(options.progress_format, options.progress_interval);
+
+  auto needs_samples = [&](const PixelStats &stats) {
+    if (stats.samples() >= max_samples)
+      return false;
+    return !adaptive || stats.samples() < min_samples ||
+           stats.relative_error() >= max_relative_error;
+  };
+  // When the budget left cannot give every pixel needing samples one more,
+  // a pass only samples the noisiest, with a relative error of at least
+  // error_floor
+  double error_floor = 0;
+  auto in_pass = [&](const PixelStats &stats) {
+    return needs_samples(stats) &&
+           (error_floor <= 0 || stats.relative_error() >= error_floor);
+  };
+
+  int passes_done = 0;
+  if (options.resume) {
+    if (!load_checkpoint(options.checkpoint_path, film, passes_done,
+                         fingerprint.value())) {
+      return EXIT_FAILURE;
+    }
+    std::cerr << "Resuming after pass " << passes_done << " from '"
+              << options.checkpoint_path << "'." << std::endl;
+  }
+
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
+
+  progress.start();
   auto t1 = std::chrono::high_resolution_clock::now();
-  std::for_each(std::execution::par_unseq, ys.begin(), ys.end(), [&](int y) {
-    for (int x = 0; x < image_width; ++x) {
-      Color pixel_color(0, 0, 0);
-      for (int s = 0; s < samples_per_pixel; s++) {
-        auto u = (x + random_double()) / (image_width - 1);
-        auto v = (y + random_double()) / (image_height - 1);
-        Ray r = cam.get_ray(u, v);
-        pixel_color += ray_color(r, background, world, max_depth);
+  auto last_snapshot = t1;
+  auto last_checkpoint = t1;
+  const auto deadline =
+      program_start + std::chrono::duration_cast<decltype(t1)::duration>(
+               std::chrono::duration<double>(options.time_budget));
+  if (options.time_budget > 0) {
+    progress.set_time_limit(deadline - t1);
+  }
+  double render_seconds = 0;
+  double save_seconds = 0;
+  unsigned long long samples_traced = 0;
+  std::size_t active_estimate = image_width * image_height;
+  bool complete = false;
+  for (int pass = passes_done + 1;; ++pass) {
+    int pass_samples = samples_per_pass;
+    if (options.time_budget > 0) {
+      if (samples_traced == 0) {
+        pass_samples = 1;
+      } else {
+        std::chrono::duration<double> remaining =
+            deadline - std::chrono::high_resolution_clock::now();
+        const auto samples_per_second = samples_traced / render_seconds;
+        // Keep a little slack for timing noise between passes. Only whole
+        // samples fit, and the estimate is clamped before it is converted
+        // so a pass too quick to time cannot overflow it.
+        const auto budget = (0.95 * remaining.count() - save_seconds) *
+                            samples_per_second / active_estimate;
+        const auto affordable = static_cast<long long>(
+            std::min(std::max(0.0, std::floor(budget)), 1e15));
+        if (pass == passes_done + 2) {
+          std::cerr << "\rTime budget allows about " << affordable + 1
+                    << " more samples per pixel at " << samples_per_second
+                    << " samples/s" << std::endl;
+        }
+        if (affordable < 1) {
+          std::cerr << "\nTime budget used up after pass " << pass - 1 << "."
+                    << std::endl;
+          if (!save_checkpoint(options.checkpoint_path, film, pass - 1,
+                               fingerprint.value())) {
+            std::cerr << "ERROR: Could not write checkpoint '"
+                      << options.checkpoint_path << "'." << std::endl;
+          }
+          break;
+        }
+        pass_samples = static_cast<int>(
+            std::min<long long>(pass_samples, affordable));
       }
-      write_color(img, x, y, pixel_color / samples_per_pixel);
     }
-    lines_mutex.lock();
-    lines++;
-    std::cout << "\rFinished line " << lines << " of " << image_height
-              << " lines" << std::flush;
-    lines_mutex.unlock();
-  });
-  std::cout << std::endl;
+
+    // At most every pixel still needing samples gets all it may take
+    std::size_t needing = 0;
+    unsigned long long remaining = 0;
+    for (unsigned y = 0; y < image_height; ++y) {
+      for (unsigned x = 0; x < image_width; ++x) {
+        const auto &stats = film.at(x, y);
+        if (needs_samples(stats)) {
+          needing++;
+          remaining += max_samples - stats.samples();
+        }
+      }
+    }
+
+    // Adaptive renders end when the sample budget is spent. The last passes
+    // shrink to what is left, and when not even a sample per pixel is left
+    // it goes to the noisiest pixels.
+    error_floor = 0;
+    if (adaptive && needing > 0) {
+      const auto spent = film.total_samples();
+      const auto left = spent < sample_budget ? sample_budget - spent : 0;
+      if (left == 0) {
+        complete = true;
+        break;
+      }
+      remaining = std::min(remaining, left);
+      if (left < static_cast<unsigned long long>(needing) * pass_samples) {
+        pass_samples = static_cast<int>(std::max<unsigned long long>(
+            1, left / needing));
+      }
+      if (left < needing) {
+        std::vector<double> errors;
+        errors.reserve(needing);
+        for (unsigned y = 0; y < image_height; ++y) {
+          for (unsigned x = 0; x < image_width; ++x) {
+            const auto &stats = film.at(x, y);
+            if (needs_samples(stats))
+              errors.push_back(stats.relative_error());
+          }
+        }
+        const auto kth = errors.begin() + (needing - left);
+        std::nth_element(errors.begin(), kth, errors.end());
+        error_floor = *kth;
+      }
+    }
+
+    std::atomic<std::size_t> active_pixels(0);
+    auto pass_start = std::chrono::high_resolution_clock::now();
+    const auto traced_before = progress.samples();
+    progress.set_remaining(remaining);
+    progress.begin_pass(pass, tile_count,
+                        static_cast<unsigned long long>(active_estimate) *
+                            pass_samples);
+
+    renderer.render([&](const Tile &tile) {
+      std::vector<Wavefront::Job> jobs;
+      for (unsigned y = tile.y0; y < tile.y1; ++y) {
+        for (unsigned x = tile.x0; x < tile.x1; ++x) {
+          const auto &stats = film.at(x, y);
+          if (!in_pass(stats))
+            continue;
+          const int first = stats.samples();
+          jobs.push_back(
+              {x, y, first, std::min(first + pass_samples, max_samples)});
+        }
+      }
+      active_pixels += jobs.size();
+
+      unsigned long long tile_samples = 0;
+      unsigned long long tile_rays = 0;
+      if (options.integrator == Integrator::Wavefront) {
+        std::vector<Color> radiance;
+        tile_rays = wavefront.trace(jobs, radiance);
+
+        auto next = radiance.begin();
+        for (const auto &job : jobs) {
+          auto &stats = film.at(job.x, job.y);
+          for (int s = job.first; s < job.last; s++) {
+            stats.add(*next++);
+          }
+          tile_samples += job.last - job.first;
+        }
+      } else {
+        for (const auto &job : jobs) {
+          auto &stats = film.at(job.x, job.y);
+          const auto pixel =
+              static_cast<std::uint64_t>(job.y) * image_width + job.x;
+          for (int s = job.first; s < job.last; s++) {
+            // Random numbers depend only on the pixel and sample, never on
+            // the thread, so the image is the same for any thread count
+            Sampler sampler(pixel, s);
+            auto u = (job.x + sampler.random_double()) / (image_width - 1);
+            auto v = (job.y + sampler.random_double()) / (image_height - 1);
+            Ray r = cam.get_ray(u, v, sampler);
+            stats.add(ray_color(r, background, world, max_depth,
+                                roulette_depth, sampler));
+            tile_rays += sampler.bounces();
+          }
+          tile_samples += job.last - job.first;
+        }
+      }
+      progress.tile_done(tile_samples, tile_rays);
+    });
+
+    if (active_pixels == 0) {
+      complete = true;
+      break;
+    }
+
+    auto now = std::chrono::high_resolution_clock::now();
+    render_seconds += std::chrono::duration<double>(now - pass_start).count();
+    samples_traced += progress.samples() - traced_before;
+    active_estimate = active_pixels;
+
+    std::chrono::duration<double> since_checkpoint = now - last_checkpoint;
+    if (stop_requested || (options.checkpoint_interval > 0 &&
+                           since_checkpoint.count() >=
+                               options.checkpoint_interval)) {
+      if (!save_checkpoint(options.checkpoint_path, film, pass,
+                           fingerprint.value())) {
+        std::cerr << "\nERROR: Could not write checkpoint '"
+                  << options.checkpoint_path << "'." << std::endl;
+      }
+      last_checkpoint = now;
+    }
+    if (stop_requested) {
+      std::cerr << "\nStopped after pass " << pass << ", resume with --resume."
+                << std::endl;
+      break;
+    }
+
+    std::chrono::duration<double> since_snapshot = now - last_snapshot;
+    if (pass % snapshot_passes == 0 ||
+        since_snapshot.count() >= snapshot_interval) {
+      save_film(film, max_samples);
+      last_snapshot = std::chrono::high_resolution_clock::now();
+      save_seconds = std::max(
+          save_seconds,
+          std::chrono::duration<double>(last_snapshot - now).count());
+    }
+  }
+  progress.stop();
 
   auto t2 = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double, std::milli> ms_double = t2 - t1;
   std::cerr << "Time taken: " << ms_double.count() << " ms" << std::endl;
+  std::cerr << "Rays traced: " << progress.rays() << " ("
+            << progress.rays() / (ms_double.count() / 1000) << " rays/s)"
+            << std::endl;
+  std::cerr << "Average samples per pixel: "
+            << static_cast<double>(film.total_samples()) /
+                   (image_width * image_height)
+            << std::endl;
 
   std::cerr << "Saving file..." << std::endl;
-  lodepng::encode(FILE_NAME, img.data(), image_width, image_height, LCT_RGB);
+  save_film(film, max_samples);
+  if (complete) {
+    // Nothing is left to resume
+    std::remove(options.checkpoint_path.c_str());
+  }
   std::cerr << "Done.\n";
   return EXIT_SUCCESS;
 }
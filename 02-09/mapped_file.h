@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A file mapped into memory (POSIX mmap).
+ *
+ * Writes go straight into the page cache, so they survive the process being
+ * killed. sync() flushes them to disk to survive the machine going away too.
+ */
+class MappedFile {
+public:
+  MappedFile() {}
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() { close(); }
+
+  // Creates (or truncates) path with the given size, mapped for writing
+  bool create(const std::string &path, std::size_t size);
+
+  // Maps an existing file read-only
+  bool open(const std::string &path);
+
+  bool sync() const {
+    return addr == nullptr || msync(addr, length, MS_SYNC) == 0;
+  }
+
+  void close() {
+    if (addr != nullptr) {
+      munmap(addr, length);
+    }
+    addr = nullptr;
+    length = 0;
+  }
+
+  unsigned char *data() { return static_cast<unsigned char *>(addr); }
+  const unsigned char *data() const {
+    return static_cast<const unsigned char *>(addr);
+  }
+  std::size_t size() const { return length; }
+
+private:
+  bool map(int fd, std::size_t size, int prot);
+
+  void *addr = nullptr;
+  std::size_t length = 0;
+};
+
+inline bool MappedFile::create(const std::string &path, std::size_t size) {
+  close();
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  bool ok = ftruncate(fd, size) == 0 && map(fd, size, PROT_READ | PROT_WRITE);
+  ::close(fd);
+  return ok;
+}
+
+inline bool MappedFile::open(const std::string &path) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0 && map(fd, st.st_size, PROT_READ);
+  ::close(fd);
+  return ok;
+}
+
+inline bool MappedFile::map(int fd, std::size_t size, int prot) {
+  if (size == 0)
+    return false;
+  void *p = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return false;
+  addr = p;
+  length = size;
+  return true;
+}
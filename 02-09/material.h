@@ -1,6 +1,7 @@
 #pragma once
 #include "ray.h"
 #include "rtweekend.h"
+#include "sampler.h"
 #include "vec3.h"
 
 struct HitRecord;
@@ -14,5 +15,6 @@ public:
   }
 
   virtual bool scatter(const Ray &r_in, const HitRecord &rec,
-                       Color &attenuation, Ray &scattered) const = 0;
+                       Color &attenuation, Ray &scattered,
+                       Sampler &sampler) const = 0;
 };
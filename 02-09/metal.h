@@ -8,11 +8,12 @@ public:
   virtual ~Metal() = default;
 
   virtual bool scatter(const Ray &r_in, const HitRecord &rec,
-                       Color &attentuation, Ray &scattered) const override {
+                       Color &attentuation, Ray &scattered,
+                       Sampler &sampler) const override {
     Vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
     do {
-      scattered =
-          Ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+      scattered = Ray(rec.p, reflected + fuzz * random_in_unit_sphere(sampler),
+                      r_in.time());
     } while (dot(scattered.direction(), rec.normal) <= 0);
     attentuation = albedo;
     return true;
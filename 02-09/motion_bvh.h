@@ -0,0 +1,237 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "ray.h"
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Bounds at shutter open and close, rounded outwards to floats
+struct alignas(64) MotionBvhNode {
+  float bounds[2][2][3]; // [open, close][min, max][axis]
+  std::uint32_t offset;  // leaf: first primitive, interior: second child
+  std::uint16_t count;   // primitives in a leaf, 0 for interior nodes
+  std::uint8_t axis;     // split axis of interior nodes
+  std::uint8_t pad;
+
+  bool leaf() const { return count > 0; }
+};
+
+/**
+ * A linear BVH for motion blur. Every node stores its bounds at shutter open
+ * (time0) and shutter close (time1), and a ray at time t is tested against
+ * the box interpolated between them. A primitive moving linearly stays
+ * inside its interpolated box, and so does anything under an interpolated
+ * node, so the boxes only cover where the geometry is at the ray's time
+ * instead of its whole path during the shutter.
+ *
+ * The tree itself comes from BvhBuilder over the whole shutter bounds, and
+ * rays are expected to carry times inside [time0, time1].
+ */
+class MotionBvh : public Hittable {
+public:
+  MotionBvh(const HittableList &list, double time0, double time1,
+            const BvhBuildOptions &options)
+      : MotionBvh(BvhBuilder(options).build(
+                      bvh_primitives(list.objects, time0, time1)),
+                  list.objects, time0, time1) {}
+
+  MotionBvh(const BvhBuild &build,
+            const std::vector<std::shared_ptr<Hittable>> &objects,
+            double time0, double time1);
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   HitRecord &rec) const override;
+
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
+
+  virtual bool bounding_box(double time0, double time1,
+                            Aabb &output_box) const override {
+    output_box = box;
+    return !nodes.empty();
+  }
+
+  const std::vector<MotionBvhNode> &node_array() const { return nodes; }
+
+private:
+  static const int max_stack = max_bvh_depth;
+
+  // Returns the node index, open and close are set to its bounds
+  std::uint32_t flatten(const BvhBuild &build, std::uint32_t node,
+                        Aabb &open, Aabb &close);
+
+  // Slab test against node's bounds at interpolation weight w
+  static bool hit_node(const MotionBvhNode &node, double w, const Ray &r,
+                       double tmin, double tmax);
+
+  std::vector<MotionBvhNode> nodes;
+  std::vector<const Hittable *> prims;
+  std::vector<std::shared_ptr<Hittable>> owned; // keeps prims alive
+  double time0, time1;
+  Aabb box;
+};
+
+inline MotionBvh::MotionBvh(
+    const BvhBuild &build,
+    const std::vector<std::shared_ptr<Hittable>> &objects, double time0,
+    double time1)
+    : time0(time0), time1(time1) {
+  owned.reserve(build.prims.size());
+  prims.reserve(build.prims.size());
+  for (const auto &prim : build.prims) {
+    owned.push_back(objects[prim.index]);
+    prims.push_back(owned.back().get());
+  }
+
+  if (build.nodes.empty())
+    return;
+  box = build.nodes[0].bounds;
+  nodes.reserve(build.nodes.size());
+  Aabb open, close;
+  flatten(build, 0, open, close);
+}
+
+inline std::uint32_t MotionBvh::flatten(const BvhBuild &build,
+                                        std::uint32_t node, Aabb &open,
+                                        Aabb &close) {
+  const auto &n = build.nodes[node];
+  const auto index = static_cast<std::uint32_t>(nodes.size());
+  nodes.emplace_back();
+
+  open = Aabb::empty();
+  close = Aabb::empty();
+  if (n.leaf()) {
+    for (auto i = n.first; i < n.first + n.count; i++) {
+      Aabb b;
+      prims[i]->bounding_box(time0, time0, b);
+      open = surrounding_box(open, b);
+      prims[i]->bounding_box(time1, time1, b);
+      close = surrounding_box(close, b);
+    }
+    nodes[index].offset = n.first;
+    nodes[index].count = static_cast<std::uint16_t>(n.count);
+  } else {
+    Aabb child_open, child_close;
+    flatten(build, n.child[0], child_open, child_close);
+    open = child_open;
+    close = child_close;
+    auto second = flatten(build, n.child[1], child_open, child_close);
+    open = surrounding_box(open, child_open);
+    close = surrounding_box(close, child_close);
+    nodes[index].offset = second;
+    nodes[index].count = 0;
+  }
+
+  auto &out = nodes[index];
+  for (int a = 0; a < 3; a++) {
+    out.bounds[0][0][a] = round_down(open.min()[a]);
+    out.bounds[0][1][a] = round_up(open.max()[a]);
+    out.bounds[1][0][a] = round_down(close.min()[a]);
+    out.bounds[1][1][a] = round_up(close.max()[a]);
+  }
+  out.axis = static_cast<std::uint8_t>(n.axis);
+  out.pad = 0;
+  return index;
+}
+
+inline bool MotionBvh::hit_node(const MotionBvhNode &node, double w,
+                                const Ray &r, double tmin, double tmax) {
+  for (int a = 0; a < 3; a++) {
+    const auto min = (1 - w) * node.bounds[0][0][a] + w * node.bounds[1][0][a];
+    const auto max = (1 - w) * node.bounds[0][1][a] + w * node.bounds[1][1][a];
+    const auto lo = r.getSign(a) ? max : min;
+    const auto hi = r.getSign(a) ? min : max;
+    const auto t0 = (lo - r.origin()[a]) * r.invDirection()[a];
+    const auto t1 = (hi - r.origin()[a]) * r.invDirection()[a];
+    tmin = t0 > tmin ? t0 : tmin;
+    tmax = t1 < tmax ? t1 : tmax;
+    if (tmax < tmin)
+      return false;
+  }
+  return true;
+}
+
+inline bool MotionBvh::hit(const Ray &r, double t_min, double t_max,
+                           HitRecord &rec) const {
+  if (nodes.empty())
+    return false;
+
+  const auto w =
+      time1 > time0 ? clamp((r.time() - time0) / (time1 - time0), 0.0, 1.0)
+                    : 0.0;
+  std::uint32_t stack[max_stack];
+  int top = 0;
+  std::uint32_t current = 0;
+  bool hit_anything = false;
+
+  while (true) {
+    const auto &node = nodes[current];
+    if (hit_node(node, w, r, t_min, t_max)) {
+      if (node.leaf()) {
+        for (auto i = node.offset; i < node.offset + node.count; i++) {
+          if (prims[i]->hit(r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+          }
+        }
+      } else if (r.getSign(node.axis)) {
+        stack[top++] = current + 1;
+        current = node.offset;
+        continue;
+      } else {
+        stack[top++] = node.offset;
+        current = current + 1;
+        continue;
+      }
+    }
+    if (top == 0)
+      break;
+    current = stack[--top];
+  }
+
+  return hit_anything;
+}
+
+inline bool MotionBvh::occluded(const Ray &r, double t_min,
+                                double t_max) const {
+  if (nodes.empty())
+    return false;
+
+  // The same walk as hit, returning at the first primitive hit
+  const auto w =
+      time1 > time0 ? clamp((r.time() - time0) / (time1 - time0), 0.0, 1.0)
+                    : 0.0;
+  std::uint32_t stack[max_stack];
+  int top = 0;
+  std::uint32_t current = 0;
+
+  while (true) {
+    const auto &node = nodes[current];
+    if (hit_node(node, w, r, t_min, t_max)) {
+      if (node.leaf()) {
+        for (auto i = node.offset; i < node.offset + node.count; i++) {
+          if (prims[i]->occluded(r, t_min, t_max))
+            return true;
+        }
+      } else if (r.getSign(node.axis)) {
+        stack[top++] = current + 1;
+        current = node.offset;
+        continue;
+      } else {
+        stack[top++] = node.offset;
+        current = current + 1;
+        continue;
+      }
+    }
+    if (top == 0)
+      return false;
+    current = stack[--top];
+  }
+}
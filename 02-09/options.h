@@ -0,0 +1,194 @@
+#pragma once
+
+#include "accelerator.h"
+#include "bvh_build.h"
+#include "progress.h"
+#include "renderer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+enum class Integrator { Path, Wavefront };
+
+// Command line settings. Everything else is still configured in main.
+struct Options {
+  bool resume = false;
+  std::string checkpoint_path = "out.ckpt";
+  double checkpoint_interval = 600.0; // seconds, 0 disables checkpoints
+  double time_budget = 0.0;           // seconds, 0 renders until done
+  ProgressFormat progress_format = ProgressFormat::Text;
+  double progress_interval = 1.0; // seconds
+  unsigned tile_size = 32;        // pixels along each side of a tile
+  bool adaptive = true;
+  int min_samples = 64;             // before a pixel may count as converged
+  int max_samples = 0;              // per pixel, 0 is 4x the average budget
+  double max_relative_error = 0.01; // of a pixel's luminance
+  TileOrder tile_order = TileOrder::Morton;
+  Integrator integrator = Integrator::Path;
+  Accelerator accelerator = Accelerator::Bvh8;
+  BvhSplit bvh_split = BvhSplit::Sah;
+  int bvh_leaf_size = 4;
+  std::string bvh_cache; // directory, empty disables the cache
+  bool bvh_benchmark = false;
+  bool bvh_stats = false;
+};
+
+inline void print_usage(const char *program) {
+  std::cerr << "Usage: " << program << " [options]\n"
+            << "  --resume                    continue from the checkpoint\n"
+            << "  --checkpoint=PATH           checkpoint file (out.ckpt)\n"
+            << "  --checkpoint-interval=SECS  time between checkpoints, 0 "
+               "disables them (600)\n"
+            << "  --time-budget=SECS          finish within SECS seconds\n"
+            << "  --progress=text|json        progress report format (text)\n"
+            << "  --progress-interval=SECS    time between reports, at least\n"
+            << "                              0.01 (1)\n"
+            << "  --tile-size=N               tile width and height in pixels "
+               "(32)\n"
+            << "  --tile-order=scanline|morton|spiral\n"
+            << "                              order tiles are dealt out to "
+               "threads (morton)\n"
+            << "  --adaptive=on|off           move samples from converged to "
+               "noisy pixels,\n"
+            << "                              within the same total (on)\n"
+            << "  --min-samples=N             samples before a pixel may stop "
+               "(64)\n"
+            << "  --max-samples=N             most samples of one pixel, 0 "
+               "for 4x the\n"
+            << "                              average (0)\n"
+            << "  --max-error=X               relative error a pixel stops "
+               "at (0.01)\n"
+            << "  --integrator=path|wavefront depth first or queue based "
+               "path tracing (path)\n"
+            << "  --accel=tree|linear|bvh4|bvh8|motion|quantized|grid|kdtree|"
+               "lazy\n"
+            << "                              BVH layout: linked nodes, a flat "
+               "array,\n"
+            << "                              4/8 wide SIMD nodes, bounds per "
+               "shutter\n"
+            << "                              time for motion blur, 8 wide "
+               "nodes with\n"
+            << "                              8 bit boxes, or a uniform grid "
+               "or\n"
+            << "                              kd-tree instead of a BVH, or a "
+               "BVH built\n"
+            << "                              as rays reach its nodes (bvh8)\n"
+            << "  --bvh=median|sah|lbvh|sbvh  BVH builder, lbvh is fastest to "
+               "build, sbvh\n"
+            << "                              splits large overlapping "
+               "primitives (sah)\n"
+            << "  --bvh-leaf-size=N           primitives per BVH leaf, sah "
+               "and lbvh (4)\n"
+            << "  --bvh-cache=DIR             reuse BVH builds saved in DIR "
+               "by earlier runs\n"
+            << "  --bvh-benchmark             compare the BVH builders and "
+               "exit\n"
+            << "  --bvh-stats                 print statistics of every BVH "
+               "the scene\n"
+            << "                              builds, one JSON line each, and "
+               "exit\n";
+}
+
+// Fills options from the command line. Returns false on anything it does not
+// understand.
+inline bool parse_options(int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const auto eq = arg.find('=');
+    const auto name = arg.substr(0, eq);
+    const auto value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+    if (name == "--resume" && eq == std::string::npos) {
+      options.resume = true;
+    } else if (name == "--checkpoint" && !value.empty()) {
+      options.checkpoint_path = value;
+    } else if (name == "--checkpoint-interval" && !value.empty()) {
+      options.checkpoint_interval = std::atof(value.c_str());
+    } else if (name == "--time-budget" && !value.empty()) {
+      options.time_budget = std::atof(value.c_str());
+    } else if (name == "--progress" && (value == "text" || value == "json")) {
+      options.progress_format =
+          value == "json" ? ProgressFormat::Json : ProgressFormat::Text;
+    } else if (name == "--progress-interval" && !value.empty()) {
+      options.progress_interval = std::atof(value.c_str());
+      if (!(options.progress_interval >= Progress::min_interval)) {
+        std::cerr << "Progress interval must be at least "
+                  << Progress::min_interval << " seconds.\n";
+        return false;
+      }
+    } else if (name == "--tile-size" && !value.empty()) {
+      const auto size = std::atoi(value.c_str());
+      if (size < 1) {
+        std::cerr << "Tile size must be at least 1 pixel.\n";
+        return false;
+      }
+      options.tile_size = static_cast<unsigned>(size);
+    } else if (name == "--tile-order" &&
+               (value == "scanline" || value == "morton" ||
+                value == "spiral")) {
+      options.tile_order = value == "scanline" ? TileOrder::Scanline
+                           : value == "spiral" ? TileOrder::Spiral
+                                               : TileOrder::Morton;
+    } else if (name == "--adaptive" && (value == "on" || value == "off")) {
+      options.adaptive = value == "on";
+    } else if (name == "--min-samples" && !value.empty()) {
+      options.min_samples = std::atoi(value.c_str());
+      if (options.min_samples < 1) {
+        std::cerr << "Minimum samples must be at least 1.\n";
+        return false;
+      }
+    } else if (name == "--max-samples" && !value.empty()) {
+      options.max_samples = std::atoi(value.c_str());
+      if (options.max_samples < 0) {
+        std::cerr << "Maximum samples must not be negative.\n";
+        return false;
+      }
+    } else if (name == "--max-error" && !value.empty()) {
+      options.max_relative_error = std::atof(value.c_str());
+      if (!(options.max_relative_error > 0)) {
+        std::cerr << "Maximum relative error must be positive.\n";
+        return false;
+      }
+    } else if (name == "--integrator" &&
+               (value == "path" || value == "wavefront")) {
+      options.integrator =
+          value == "wavefront" ? Integrator::Wavefront : Integrator::Path;
+    } else if (name == "--accel" &&
+               (value == "tree" || value == "linear" || value == "bvh4" ||
+                value == "bvh8" || value == "motion" ||
+                value == "quantized" || value == "grid" ||
+                value == "kdtree" || value == "lazy")) {
+      options.accelerator = value == "tree"        ? Accelerator::BvhTree
+                            : value == "linear"    ? Accelerator::BvhLinear
+                            : value == "bvh4"      ? Accelerator::Bvh4
+                            : value == "motion"    ? Accelerator::BvhMotion
+                            : value == "quantized" ? Accelerator::BvhQuantized
+                            : value == "grid"      ? Accelerator::Grid
+                            : value == "kdtree"    ? Accelerator::KdTree
+                            : value == "lazy"      ? Accelerator::BvhLazy
+                                                   : Accelerator::Bvh8;
+    } else if (name == "--bvh" &&
+               (value == "median" || value == "sah" || value == "lbvh" ||
+                value == "sbvh")) {
+      options.bvh_split = value == "median" ? BvhSplit::Median
+                          : value == "lbvh" ? BvhSplit::Lbvh
+                          : value == "sbvh" ? BvhSplit::Sbvh
+                                            : BvhSplit::Sah;
+    } else if (name == "--bvh-leaf-size" && !value.empty()) {
+      options.bvh_leaf_size =
+          std::min(255, std::max(1, std::atoi(value.c_str())));
+    } else if (name == "--bvh-cache" && !value.empty()) {
+      options.bvh_cache = value;
+    } else if (name == "--bvh-benchmark" && eq == std::string::npos) {
+      options.bvh_benchmark = true;
+    } else if (name == "--bvh-stats" && eq == std::string::npos) {
+      options.bvh_stats = true;
+    } else {
+      std::cerr << "Unknown argument '" << arg << "'.\n";
+      return false;
+    }
+  }
+  return true;
+}
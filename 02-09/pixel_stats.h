@@ -0,0 +1,76 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+inline double luminance(const Color &c) {
+  return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+/**
+ * Running estimate of a pixel: the colour sum plus the mean and variance of
+ * the sample luminance (Welford's online algorithm).
+ *
+ * The relative error is the standard error of the mean divided by the mean.
+ * It drives adaptive sampling, once it drops below a threshold more samples
+ * will not visibly change the pixel.
+ */
+class PixelStats {
+public:
+  // Plain, fixed layout copy of the state for checkpoint files
+  struct Record {
+    double sum[3];
+    double lum_mean;
+    double lum_m2;
+    std::uint64_t count;
+  };
+
+  Record record() const {
+    return {{sum.x(), sum.y(), sum.z()}, lum_mean, lum_m2, count};
+  }
+
+  static PixelStats from_record(const Record &r) {
+    PixelStats stats;
+    stats.sum = Color(r.sum[0], r.sum[1], r.sum[2]);
+    stats.lum_mean = r.lum_mean;
+    stats.lum_m2 = r.lum_m2;
+    stats.count = static_cast<unsigned>(r.count);
+    return stats;
+  }
+
+  void add(const Color &sample) {
+    sum += sample;
+    count++;
+
+    auto l = luminance(sample);
+    auto delta = l - lum_mean;
+    lum_mean += delta / count;
+    lum_m2 += delta * (l - lum_mean);
+  }
+
+  unsigned samples() const { return count; }
+
+  Color mean() const {
+    return count == 0 ? Color(0, 0, 0) : sum / static_cast<double>(count);
+  }
+
+  double variance() const { return count < 2 ? inf : lum_m2 / (count - 1); }
+
+  double relative_error() const {
+    if (count < 2)
+      return inf;
+    // Very dark pixels would otherwise never count as converged
+    const auto floor = 1e-3;
+    return std::sqrt(variance() / count) / std::max(lum_mean, floor);
+  }
+
+private:
+  Color sum;
+  double lum_mean = 0;
+  double lum_m2 = 0;
+  unsigned count = 0;
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+enum class ProgressFormat { Text, Json };
+
+/**
+ * Render progress shared between the render threads and a reporter thread.
+ *
+ * Render threads only bump atomic counters once per finished tile, they never
+ * lock or print. A single reporter thread wakes up every interval seconds and
+ * prints the rate, rays per second and the estimated time left, either as a
+ * status line or as one JSON object per line for job schedulers.
+ *
+ * The time left is for the whole render: the samples still to trace at the
+ * rate so far, or the time to the deadline when that comes first.
+ */
+class Progress {
+public:
+  // Intervals are at least min_interval, so the reporter never spins
+  Progress(ProgressFormat format, double interval)
+      : format(format), interval(std::max(interval, min_interval)) {}
+  Progress(const Progress &) = delete;
+  Progress &operator=(const Progress &) = delete;
+  ~Progress() { stop(); }
+
+  void start();
+
+  // Prints a last report and joins the reporter thread
+  void stop();
+
+  // Called between passes, expected_samples is an estimate for the pass
+  void begin_pass(int pass, std::size_t tiles,
+                  unsigned long long expected_samples) {
+    pass_number = pass;
+    pass_tiles = tiles;
+    pass_expected = expected_samples;
+    pass_tiles_done = 0;
+    pass_samples = 0;
+  }
+
+  // Called between passes with an upper bound on the samples the rest of the
+  // render traces
+  void set_remaining(unsigned long long samples) {
+    render_target = total_samples + samples;
+  }
+
+  // The render stops time_left from now at the latest
+  void set_time_limit(std::chrono::duration<double> time_left) {
+    deadline = std::chrono::steady_clock::now() +
+               std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                   time_left);
+    has_deadline = true;
+  }
+
+  // Called by render threads once per tile
+  void tile_done(unsigned long long samples, unsigned long long rays) {
+    pass_tiles_done.fetch_add(1, std::memory_order_relaxed);
+    pass_samples.fetch_add(samples, std::memory_order_relaxed);
+    total_samples.fetch_add(samples, std::memory_order_relaxed);
+    total_rays.fetch_add(rays, std::memory_order_relaxed);
+  }
+
+  unsigned long long samples() const { return total_samples; }
+  unsigned long long rays() const { return total_rays; }
+
+  static constexpr double min_interval = 0.01; // seconds
+
+private:
+  void report(bool last);
+
+  ProgressFormat format;
+  double interval;
+  std::chrono::steady_clock::time_point start_time;
+
+  std::atomic<int> pass_number{0};
+  std::atomic<std::size_t> pass_tiles{0};
+  std::atomic<std::size_t> pass_tiles_done{0};
+  std::atomic<unsigned long long> pass_expected{0};
+  std::atomic<unsigned long long> pass_samples{0};
+  std::atomic<unsigned long long> total_samples{0};
+  std::atomic<unsigned long long> total_rays{0};
+  std::atomic<unsigned long long> render_target{0};
+  std::atomic<bool> has_deadline{false};
+  std::chrono::steady_clock::time_point deadline; // set before has_deadline
+
+  std::thread reporter;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+};
+
+inline void Progress::start() {
+  start_time = std::chrono::steady_clock::now();
+  stopping = false;
+  reporter = std::thread([this] {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!wake.wait_for(lock, std::chrono::duration<double>(interval),
+                          [this] { return stopping; })) {
+      report(false);
+    }
+  });
+}
+
+inline void Progress::stop() {
+  if (!reporter.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  reporter.join();
+  report(true);
+}
+
+inline void Progress::report(bool last) {
+  const auto now = std::chrono::steady_clock::now();
+  const std::chrono::duration<double> elapsed = now - start_time;
+  const auto seconds = std::max(elapsed.count(), 1e-9);
+  const unsigned long long samples = total_samples;
+  const unsigned long long rays = total_rays;
+  const auto samples_per_second = samples / seconds;
+  const auto rays_per_second = rays / seconds;
+
+  const unsigned long long expected = pass_expected;
+  const unsigned long long done = pass_samples;
+  const auto pass_eta = !last && samples_per_second > 0 && expected > done
+                            ? (expected - done) / samples_per_second
+                            : 0.0;
+
+  const unsigned long long target = render_target;
+  auto eta = !last && samples_per_second > 0 && target > samples
+                 ? (target - samples) / samples_per_second
+                 : 0.0;
+  if (!last && has_deadline) {
+    const std::chrono::duration<double> time_left = deadline - now;
+    eta = std::min(eta, std::max(time_left.count(), 0.0));
+  }
+
+  if (format == ProgressFormat::Json) {
+    std::cout << "{\"pass\":" << pass_number
+              << ",\"tiles_done\":" << pass_tiles_done
+              << ",\"tiles\":" << pass_tiles << ",\"samples\":" << samples
+              << ",\"rays\":" << rays << ",\"elapsed_s\":" << seconds
+              << ",\"samples_per_s\":" << samples_per_second
+              << ",\"rays_per_s\":" << rays_per_second
+              << ",\"pass_eta_s\":" << pass_eta << ",\"eta_s\":" << eta
+              << ",\"final\":" << (last ? "true" : "false") << "}"
+              << std::endl;
+  } else {
+    std::cout << "\rPass " << pass_number << ": " << pass_tiles_done << "/"
+              << pass_tiles << " tiles, " << samples_per_second / 1e6
+              << " Msamples/s, " << rays_per_second / 1e6
+              << " Mrays/s, ETA " << static_cast<long long>(eta)
+              << " s    " << (last ? "\n" : "") << std::flush;
+  }
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A rectangle of pixels, [x0, x1) x [y0, y1)
+struct Tile {
+  unsigned x0, y0;
+  unsigned x1, y1;
+};
+
+enum class TileOrder { Scanline, Morton, Spiral };
+
+/**
+ * Splits the image into tiles and renders them on a pool of threads.
+ *
+ * Every worker owns a deque of tiles. The tiles are dealt out as contiguous
+ * runs of the chosen ordering so each worker starts on a compact region of
+ * the image. A worker takes tiles from the front of its own deque and, once it
+ * runs dry, steals from the back of another worker's deque. Expensive regions
+ * (smoke, dense geometry) therefore get picked apart by idle threads instead
+ * of leaving a handful of threads finishing the frame on their own.
+ */
+class Renderer {
+public:
+  Renderer(unsigned width, unsigned height, unsigned tile_size = 32,
+           TileOrder order = TileOrder::Morton,
+           unsigned threads = std::thread::hardware_concurrency());
+
+  // Calls render_tile exactly once for every tile and blocks until all
+  // tiles are done. render_tile is called concurrently from several threads.
+  void render(const std::function<void(const Tile &)> &render_tile) const;
+
+  const std::vector<Tile> &tiles() const { return tile_list; }
+  unsigned thread_count() const { return threads; }
+
+private:
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<std::size_t> tiles;
+  };
+
+  static bool pop_front(WorkQueue &queue, std::size_t &tile);
+  static bool steal_back(WorkQueue &queue, std::size_t &tile);
+
+  // Interleaves the bits of x and y
+  static std::uint64_t morton_code(std::uint32_t x, std::uint32_t y);
+
+  std::vector<Tile> tile_list; // in render order
+  unsigned threads;
+};
+
+inline Renderer::Renderer(unsigned width, unsigned height, unsigned tile_size,
+                          TileOrder order, unsigned threads)
+    : threads(std::max(1u, threads)) {
+  tile_size = std::max(1u, tile_size);
+  const unsigned tiles_x = (width + tile_size - 1) / tile_size;
+  const unsigned tiles_y = (height + tile_size - 1) / tile_size;
+
+  struct Keyed {
+    double key;
+    Tile tile;
+  };
+  std::vector<Keyed> keyed;
+  keyed.reserve(tiles_x * tiles_y);
+
+  for (unsigned ty = 0; ty < tiles_y; ++ty) {
+    for (unsigned tx = 0; tx < tiles_x; ++tx) {
+      Tile tile{tx * tile_size, ty * tile_size,
+                std::min(width, (tx + 1) * tile_size),
+                std::min(height, (ty + 1) * tile_size)};
+
+      double key = 0;
+      switch (order) {
+      case TileOrder::Scanline:
+        key = static_cast<double>(ty) * tiles_x + tx;
+        break;
+      case TileOrder::Morton:
+        key = static_cast<double>(morton_code(tx, ty));
+        break;
+      case TileOrder::Spiral: {
+        // Rings of increasing distance from the centre, walked by angle
+        auto dx = (tx + 0.5) - tiles_x / 2.0;
+        auto dy = (ty + 0.5) - tiles_y / 2.0;
+        auto ring = std::floor(std::max(std::abs(dx), std::abs(dy)));
+        key = ring * 8 + (std::atan2(dy, dx) + pi);
+        break;
+      }
+      }
+      keyed.push_back({key, tile});
+    }
+  }
+
+  std::stable_sort(keyed.begin(), keyed.end(),
+                   [](const Keyed &a, const Keyed &b) { return a.key < b.key; });
+
+  tile_list.reserve(keyed.size());
+  for (const auto &k : keyed) {
+    tile_list.push_back(k.tile);
+  }
+}
+
+inline void
+Renderer::render(const std::function<void(const Tile &)> &render_tile) const {
+  const unsigned workers =
+      std::min<unsigned>(threads, std::max<std::size_t>(1, tile_list.size()));
+  std::vector<WorkQueue> queues(workers);
+
+  // Deal out contiguous runs so every worker starts with neighbouring tiles
+  const auto n = tile_list.size();
+  for (unsigned w = 0; w < workers; ++w) {
+    for (auto i = n * w / workers; i < n * (w + 1) / workers; ++i) {
+      queues[w].tiles.push_back(i);
+    }
+  }
+
+  auto work = [&](unsigned self) {
+    std::size_t tile;
+    while (true) {
+      if (pop_front(queues[self], tile)) {
+        render_tile(tile_list[tile]);
+        continue;
+      }
+
+      bool stole = false;
+      for (unsigned i = 1; i < workers && !stole; ++i) {
+        stole = steal_back(queues[(self + i) % workers], tile);
+      }
+      if (!stole) {
+        // Tiles are never added after the start so every queue is drained
+        return;
+      }
+      render_tile(tile_list[tile]);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  pool.reserve(workers - 1);
+  for (unsigned w = 1; w < workers; ++w) {
+    pool.emplace_back(work, w);
+  }
+  work(0);
+  for (auto &thread : pool) {
+    thread.join();
+  }
+}
+
+inline bool Renderer::pop_front(WorkQueue &queue, std::size_t &tile) {
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tiles.empty())
+    return false;
+  tile = queue.tiles.front();
+  queue.tiles.pop_front();
+  return true;
+}
+
+inline bool Renderer::steal_back(WorkQueue &queue, std::size_t &tile) {
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tiles.empty())
+    return false;
+  tile = queue.tiles.back();
+  queue.tiles.pop_back();
+  return true;
+}
+
+inline std::uint64_t Renderer::morton_code(std::uint32_t x, std::uint32_t y) {
+  auto spread = [](std::uint64_t v) {
+    v &= 0xffffffff;
+    v = (v | (v << 16)) & 0x0000ffff0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0f;
+    v = (v | (v << 2)) & 0x3333333333333333;
+    v = (v | (v << 1)) & 0x5555555555555555;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
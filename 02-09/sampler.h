@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+ * A counter-based random number generator (Philox4x32-10, from "Parallel
+ * Random Numbers: As Easy as 1, 2, 3" by Salmon et al.).
+ *
+ * There is no generator state to carry around or share. Every number is a
+ * pure function of (pixel, sample, bounce, dimension): the pixel and seed
+ * form the key, the rest forms the counter. A pixel therefore sees the same
+ * random numbers no matter which thread, tile or machine renders it, and
+ * images are bit-identical across thread counts.
+ *
+ * A Sampler is created for every camera sample. next_bounce() is called once
+ * per path segment and each random_double() call takes the next dimension.
+ */
+class Sampler {
+public:
+  Sampler(std::uint64_t pixel, std::uint64_t sample, std::uint64_t seed = 0)
+      : key{static_cast<std::uint32_t>(pixel),
+            static_cast<std::uint32_t>((pixel >> 32) ^ seed)},
+        sample(sample), bounce(0), dimension(0), buffered(false) {}
+
+  // Moves on to the next path segment and restarts the dimensions
+  void next_bounce() {
+    ++bounce;
+    dimension = 0;
+    buffered = false;
+  }
+
+  // Number of path segments started, which is the number of rays traced
+  std::uint32_t bounces() const { return bounce; }
+
+  // Returns a random real in [0,1).
+  double random_double() {
+    // Every block is 128 bits, enough for two doubles
+    if (buffered) {
+      buffered = false;
+      return to_double(block[2], block[3]);
+    }
+    block = philox({dimension++, bounce, static_cast<std::uint32_t>(sample),
+                    static_cast<std::uint32_t>(sample >> 32)},
+                   key);
+    buffered = true;
+    return to_double(block[0], block[1]);
+  }
+
+  // Returns a random real in [min,max).
+  double random_double(double min, double max) {
+    return min + (max - min) * random_double();
+  }
+
+  // Scrambles all the bits of x (the splitmix64 finalizer)
+  static std::uint64_t mix(std::uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+private:
+  using Block = std::array<std::uint32_t, 4>;
+  using Key = std::array<std::uint32_t, 2>;
+
+  static double to_double(std::uint32_t hi, std::uint32_t lo) {
+    auto bits = (static_cast<std::uint64_t>(hi) << 32) | lo;
+    return (bits >> 11) * 0x1p-53;
+  }
+
+  static Block philox(Block counter, Key k) {
+    const std::uint64_t m0 = 0xD2511F53;
+    const std::uint64_t m1 = 0xCD9E8D57;
+
+    for (int round = 0; round < 10; round++) {
+      auto p0 = m0 * counter[0];
+      auto p1 = m1 * counter[2];
+      counter = {static_cast<std::uint32_t>(p1 >> 32) ^ counter[1] ^ k[0],
+                 static_cast<std::uint32_t>(p1),
+                 static_cast<std::uint32_t>(p0 >> 32) ^ counter[3] ^ k[1],
+                 static_cast<std::uint32_t>(p0)};
+      k[0] += 0x9E3779B9;
+      k[1] += 0xBB67AE85;
+    }
+    return counter;
+  }
+
+  Key key;
+  std::uint64_t sample;
+  std::uint32_t bounce;
+  std::uint32_t dimension;
+  Block block;
+  bool buffered;
+};
@@ -16,6 +16,8 @@ public:
 
   virtual bool hit(const Ray &r, double t_min, double t_max,
                    HitRecord &rec) const override;
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
   virtual bool bounding_box(double time0, double time1,
                             Aabb &output_box) const override;
 
@@ -83,6 +85,25 @@ inline bool Sphere::hit(const Ray &r, double t_min, double t_max,
   return true;
 }
 
+inline bool Sphere::occluded(const Ray &r, double t_min, double t_max) const {
+  // The roots of hit, without the surface details
+  Vec3 oc = r.origin() - center(r.time());
+  auto a = r.direction().length_squared();
+  auto half_b = dot(oc, r.direction());
+  auto c = oc.length_squared() - radius * radius;
+  auto discriminant = half_b * half_b - a * c;
+  if (discriminant < 0) {
+    return false;
+  }
+  auto sqrtd = sqrt(discriminant);
+  auto root = (-half_b - sqrtd) / a;
+  if (!(root < t_min || t_max < root)) {
+    return true;
+  }
+  root = (-half_b + sqrtd) / a;
+  return !(root < t_min || t_max < root);
+}
+
 inline bool Sphere::bounding_box(double time0, double time1,
                                  Aabb &output_box) const {
   Aabb box0(center(time0) - Vec3(radius, radius, radius),
@@ -0,0 +1,132 @@
+// Wide BVH layouts must find the same hits as LinearBvh on scenes of flat
+// and zero area boxes, which the treelet layout has to place like any other
+// node.
+
+#include "aarect.h"
+#include "bvh_build.h"
+#include "hittable_list.h"
+#include "lambertian.h"
+#include "linear_bvh.h"
+#include "rtweekend.h"
+#include "sampler.h"
+#include "wide_bvh.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+const int stacks = 64;
+
+// Where stack i of points stands. Float boxes are rounded outwards, so only
+// coordinates floats hold exactly keep no width.
+Point3 stack_position(int i) {
+  return Point3((i * 5) % 32 + 0.5, 0, (i * 11) % 32 + 0.5);
+}
+
+// A field of coplanar rects in y = 0, and above it rects shrunk to a point
+// or a line, alone or stacked along y, whose boxes have no area at all
+HittableList flat_scene() {
+  HittableList objects;
+  auto white = std::make_shared<Lambertian>(Color(0.73, 0.73, 0.73));
+  const int side = 32;
+  for (int i = 0; i < side; i++) {
+    for (int j = 0; j < side; j++) {
+      objects.add(std::make_shared<xzRect>(i, i + 1, j, j + 1, 0, white));
+    }
+  }
+  for (int i = 0; i < 600; i++) {
+    Sampler sampler(i, 0, 1);
+    const auto x = sampler.random_double(0, side);
+    const auto y = sampler.random_double(0, 4);
+    const auto z = sampler.random_double(0, side);
+    if (i % 2 == 0) {
+      objects.add(std::make_shared<xzRect>(x, x, z, z, y, white));
+    } else {
+      objects.add(std::make_shared<xyRect>(x, x, y, y, z, white));
+    }
+  }
+  for (int i = 0; i < stacks; i++) {
+    const auto p = stack_position(i);
+    for (int k = 0; k < 8; k++) {
+      objects.add(
+          std::make_shared<xzRect>(p.x(), p.x(), p.z(), p.z(), 0.5 * k, white));
+    }
+  }
+  return objects;
+}
+
+template <typename Layout>
+int compare(const char *name, const BvhBuild &build,
+            const std::vector<std::shared_ptr<Hittable>> &objects,
+            const LinearBvh &reference, const std::vector<Ray> &rays) {
+  const Layout layout(build, objects);
+  int failures = 0;
+  for (const auto &r : rays) {
+    HitRecord expected, actual;
+    const auto expected_hit = reference.hit(r, 0.001, inf, expected);
+    const auto actual_hit = layout.hit(r, 0.001, inf, actual);
+    const auto same =
+        expected_hit == actual_hit &&
+        (!expected_hit ||
+         std::abs(expected.t - actual.t) <= 1e-9 * std::max(1.0, expected.t));
+    const auto same_occluded =
+        reference.occluded(r, 0.001, inf) == layout.occluded(r, 0.001, inf);
+    if (!same || !same_occluded) {
+      if (failures < 5) {
+        std::cerr << name << ": ray from " << r.origin() << " towards "
+                  << r.direction() << " differs from LinearBvh\n";
+      }
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int main() {
+  const auto scene = flat_scene();
+  const auto &objects = scene.objects;
+
+  // Rays down onto the field from above, and rays parallel to it inside
+  // the padding of its boxes. Rays exactly in the plane are left out, the
+  // rects hit them at a NaN distance.
+  std::vector<Ray> rays;
+  for (int i = 0; i < 20000; i++) {
+    Sampler sampler(i, 0, 2);
+    const auto in_plane = i % 4 == 0;
+    const Point3 origin(sampler.random_double(-8, 40),
+                        in_plane ? 5e-5 : sampler.random_double(0.5, 20),
+                        sampler.random_double(-8, 40));
+    const Point3 target(sampler.random_double(0, 32),
+                        in_plane ? 5e-5 : sampler.random_double(-1, 4),
+                        sampler.random_double(0, 32));
+    rays.emplace_back(origin, target - origin);
+  }
+  // Rays straight down a stack are the only ones that enter its box
+  for (int i = 0; i < stacks; i++) {
+    const auto p = stack_position(i);
+    rays.emplace_back(Point3(p.x(), 10, p.z()), Vec3(0, -1, 0));
+  }
+
+  int failures = 0;
+  for (const auto split : {BvhSplit::Sah, BvhSplit::Lbvh, BvhSplit::Sbvh}) {
+    for (const auto leaf_size : {1, 4}) {
+      BvhBuildOptions options;
+      options.split = split;
+      options.max_leaf_size = leaf_size;
+      const auto build = BvhBuilder(options).build(
+          bvh_primitives(objects, 0.0, 1.0));
+      const LinearBvh reference(build, objects);
+      failures += compare<Bvh4>("Bvh4", build, objects, reference, rays);
+      failures += compare<Bvh8>("Bvh8", build, objects, reference, rays);
+    }
+  }
+
+  if (failures > 0) {
+    std::cerr << failures << " rays differ.\n";
+    return EXIT_FAILURE;
+  }
+  std::cerr << "Wide BVH layouts agree with LinearBvh.\n";
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "aabb.h"
+#include "rtweekend.h"
+#include "vec3.h"
+
+#include <cmath>
+
+/**
+ * An affine transform stored as the top three rows of a 4x4 matrix. Points
+ * get the translation in the last column, vectors do not.
+ */
+class Transform {
+public:
+  Transform() : Transform(identity()) {}
+
+  static Transform identity() {
+    return Transform({{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}});
+  }
+
+  static Transform translate(const Vec3 &offset) {
+    return Transform({{1, 0, 0, offset.x()},
+                      {0, 1, 0, offset.y()},
+                      {0, 0, 1, offset.z()}});
+  }
+
+  static Transform scale(const Vec3 &factor) {
+    return Transform(
+        {{factor.x(), 0, 0, 0}, {0, factor.y(), 0, 0}, {0, 0, factor.z(), 0}});
+  }
+
+  // Rotation about the y axis, the same direction as rotateY
+  static Transform rotate_y(double degrees) {
+    const auto radians = degrees_to_radians(degrees);
+    const auto s = std::sin(radians);
+    const auto c = std::cos(radians);
+    return Transform({{c, 0, s, 0}, {0, 1, 0, 0}, {-s, 0, c, 0}});
+  }
+
+  Point3 point(const Point3 &p) const {
+    return Point3(row(0, p) + m[0][3], row(1, p) + m[1][3],
+                  row(2, p) + m[2][3]);
+  }
+
+  Vec3 vector(const Vec3 &v) const {
+    return Vec3(row(0, v), row(1, v), row(2, v));
+  }
+
+  // Applies the transpose of the linear part. On the inverse of a transform
+  // this maps normals the way the transform itself maps surfaces.
+  Vec3 transpose_vector(const Vec3 &v) const {
+    return Vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+  }
+
+  // The smallest box containing the transformed corners of b
+  Aabb box(const Aabb &b) const {
+    auto result = Aabb::empty();
+    for (int corner = 0; corner < 8; corner++) {
+      Point3 p((corner & 1 ? b.max() : b.min()).x(),
+               (corner & 2 ? b.max() : b.min()).y(),
+               (corner & 4 ? b.max() : b.min()).z());
+      auto q = point(p);
+      result = surrounding_box(result, Aabb(q, q));
+    }
+    return result;
+  }
+
+  Transform inverse() const;
+
+  // Applies other first, then this
+  friend Transform operator*(const Transform &a, const Transform &b);
+
+private:
+  explicit Transform(const double (&rows)[3][4]) {
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 4; j++) {
+        m[i][j] = rows[i][j];
+      }
+    }
+  }
+
+  double row(int i, const Vec3 &v) const {
+    return m[i][0] * v.x() + m[i][1] * v.y() + m[i][2] * v.z();
+  }
+
+  double m[3][4];
+};
+
+inline Transform operator*(const Transform &a, const Transform &b) {
+  double rows[3][4];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 4; j++) {
+      rows[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] +
+                   a.m[i][2] * b.m[2][j] + (j == 3 ? a.m[i][3] : 0);
+    }
+  }
+  return Transform(rows);
+}
+
+inline Transform Transform::inverse() const {
+  // Inverse of the linear part from its cofactors, then undo the translation
+  const auto &a = m;
+  const double cof[3][3] = {
+      {a[1][1] * a[2][2] - a[1][2] * a[2][1],
+       a[1][2] * a[2][0] - a[1][0] * a[2][2],
+       a[1][0] * a[2][1] - a[1][1] * a[2][0]},
+      {a[0][2] * a[2][1] - a[0][1] * a[2][2],
+       a[0][0] * a[2][2] - a[0][2] * a[2][0],
+       a[0][1] * a[2][0] - a[0][0] * a[2][1]},
+      {a[0][1] * a[1][2] - a[0][2] * a[1][1],
+       a[0][2] * a[1][0] - a[0][0] * a[1][2],
+       a[0][0] * a[1][1] - a[0][1] * a[1][0]}};
+  const auto det =
+      a[0][0] * cof[0][0] + a[0][1] * cof[0][1] + a[0][2] * cof[0][2];
+
+  double rows[3][4];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      rows[i][j] = cof[j][i] / det;
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    rows[i][3] = -(rows[i][0] * a[0][3] + rows[i][1] * a[1][3] +
+                   rows[i][2] * a[2][3]);
+  }
+  return Transform(rows);
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray.h"
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+/**
+ * A uniform grid over the scene bounds. Every cell lists the primitives
+ * whose boxes overlap it, and rays step from cell to cell along their path
+ * with a 3D digital differential analyzer, so a ray only tests the
+ * primitives in the cells it passes through, nearest cell first.
+ *
+ * The resolution aims at density cells per primitive, shaped like the
+ * bounds. Axes the scene is flat along get a single cell. Grids suit dense
+ * fields of similar sized primitives. A primitive much larger than a cell
+ * is listed in every cell it covers, and empty space costs as much to cross
+ * as full space.
+ */
+class UniformGrid : public Hittable {
+public:
+  UniformGrid(const HittableList &list, double time0, double time1,
+              double density = 4.0)
+      : UniformGrid(list.objects, time0, time1, density) {}
+
+  UniformGrid(const std::vector<std::shared_ptr<Hittable>> &objects,
+              double time0, double time1, double density = 4.0);
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   HitRecord &rec) const override;
+
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
+
+  virtual bool bounding_box(double time0, double time1,
+                            Aabb &output_box) const override {
+    output_box = box;
+    return !owned.empty();
+  }
+
+  int resolution(int axis) const { return res[axis]; }
+  std::size_t cell_count() const { return offsets.size() - 1; }
+  std::size_t reference_count() const { return prims.size(); }
+
+private:
+  // Calls visit(first, last, exit) for every cell the ray crosses inside
+  // [t_min, t_max], nearest first, with the primitive range of the cell and
+  // the distance the ray leaves it. Stops early when visit returns true.
+  template <typename Visit>
+  bool walk(const Ray &r, double t_min, double t_max, Visit visit) const;
+
+  // The cell along axis holding coordinate x, clamped to the grid
+  int cell_of(double x, int axis) const {
+    auto c = static_cast<int>((x - box.min()[axis]) * inv_cell_size[axis]);
+    return std::min(std::max(c, 0), res[axis] - 1);
+  }
+
+  Aabb box;
+  int res[3] = {1, 1, 1};
+  double cell_size[3];
+  double inv_cell_size[3];
+  std::vector<std::uint32_t> offsets; // cell i lists prims[offsets[i]..[i+1])
+  std::vector<const Hittable *> prims;
+  std::vector<std::shared_ptr<Hittable>> owned; // keeps prims alive
+};
+
+inline UniformGrid::UniformGrid(
+    const std::vector<std::shared_ptr<Hittable>> &objects, double time0,
+    double time1, double density)
+    : owned(objects) {
+  offsets.assign(2, 0);
+  if (objects.empty())
+    return;
+
+  std::vector<Aabb> boxes(objects.size());
+  box = Aabb::empty();
+  for (std::size_t i = 0; i < objects.size(); i++) {
+    if (!objects[i]->bounding_box(time0, time1, boxes[i])) {
+      std::cerr << "No bounding box in UniformGrid constructor." << std::endl;
+    }
+    box = surrounding_box(box, boxes[i]);
+  }
+
+  // Cells per unit length k gives prod(extent * k) = density * count cells.
+  // Axes with less than one cell at that k get one, and k is solved again
+  // over the others.
+  const auto extent = box.max() - box.min();
+  bool active[3];
+  for (int a = 0; a < 3; a++) {
+    active[a] = extent[a] > 0;
+  }
+  const auto cells = std::max(1.0, density * objects.size());
+  for (bool changed = true; changed;) {
+    changed = false;
+    auto volume = 1.0;
+    auto dims = 0;
+    for (int a = 0; a < 3; a++) {
+      if (active[a]) {
+        volume *= extent[a];
+        dims++;
+      }
+    }
+    if (dims == 0)
+      break;
+    const auto k = std::pow(cells / volume, 1.0 / dims);
+    for (int a = 0; a < 3; a++) {
+      if (active[a] && extent[a] * k < 1) {
+        active[a] = false;
+        changed = true;
+      }
+      res[a] = active[a] ? static_cast<int>(std::min(extent[a] * k, 1024.0))
+                         : 1;
+    }
+  }
+  for (int a = 0; a < 3; a++) {
+    cell_size[a] = extent[a] / res[a];
+    inv_cell_size[a] = extent[a] > 0 ? res[a] / extent[a] : 0;
+  }
+
+  // Count the references of every cell, then fill them in
+  const auto cell_count = static_cast<std::size_t>(res[0]) * res[1] * res[2];
+  offsets.assign(cell_count + 1, 0);
+  auto for_cells = [&](const Aabb &b, auto f) {
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; a++) {
+      lo[a] = cell_of(b.min()[a], a);
+      hi[a] = cell_of(b.max()[a], a);
+    }
+    for (int z = lo[2]; z <= hi[2]; z++)
+      for (int y = lo[1]; y <= hi[1]; y++)
+        for (int x = lo[0]; x <= hi[0]; x++)
+          f((static_cast<std::size_t>(z) * res[1] + y) * res[0] + x);
+  };
+  for (const auto &b : boxes) {
+    for_cells(b, [&](std::size_t cell) { offsets[cell + 1]++; });
+  }
+  for (std::size_t i = 0; i < cell_count; i++) {
+    offsets[i + 1] += offsets[i];
+  }
+  prims.resize(offsets[cell_count]);
+  std::vector<std::uint32_t> next(offsets.begin(), offsets.end() - 1);
+  for (std::size_t i = 0; i < boxes.size(); i++) {
+    for_cells(boxes[i], [&](std::size_t cell) {
+      prims[next[cell]++] = owned[i].get();
+    });
+  }
+}
+
+template <typename Visit>
+inline bool UniformGrid::walk(const Ray &r, double t_min, double t_max,
+                              Visit visit) const {
+  // Clip the ray to the grid
+  for (int a = 0; a < 3; a++) {
+    const auto t0 = (box.min()[a] - r.origin()[a]) * r.invDirection()[a];
+    const auto t1 = (box.max()[a] - r.origin()[a]) * r.invDirection()[a];
+    const auto near = r.getSign(a) ? t1 : t0;
+    const auto far = r.getSign(a) ? t0 : t1;
+    t_min = near > t_min ? near : t_min;
+    t_max = far < t_max ? far : t_max;
+    if (t_max < t_min)
+      return false;
+  }
+
+  // The cell the ray enters at, and the distance to its next boundary and
+  // between boundaries along each axis. Along an axis with one cell the ray
+  // only leaves through the grid bounds, which t_max already covers.
+  const auto entry = r.at(t_min);
+  int cell[3], step[3], out[3];
+  double next[3], delta[3];
+  for (int a = 0; a < 3; a++) {
+    cell[a] = cell_of(entry[a], a);
+    const auto d = res[a] > 1 ? r.direction()[a] : 0.0;
+    if (d > 0) {
+      step[a] = 1;
+      out[a] = res[a];
+      next[a] =
+          (box.min()[a] + (cell[a] + 1) * cell_size[a] - r.origin()[a]) *
+          r.invDirection()[a];
+      delta[a] = cell_size[a] * r.invDirection()[a];
+    } else if (d < 0) {
+      step[a] = -1;
+      out[a] = -1;
+      next[a] = (box.min()[a] + cell[a] * cell_size[a] - r.origin()[a]) *
+                r.invDirection()[a];
+      delta[a] = -cell_size[a] * r.invDirection()[a];
+    } else {
+      step[a] = 0;
+      out[a] = -1;
+      next[a] = inf;
+      delta[a] = inf;
+    }
+  }
+
+  while (true) {
+    const auto index =
+        (static_cast<std::size_t>(cell[2]) * res[1] + cell[1]) * res[0] +
+        cell[0];
+    const int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+                                       : (next[1] < next[2] ? 1 : 2);
+    if (visit(offsets[index], offsets[index + 1], next[axis]))
+      return true;
+    if (next[axis] > t_max)
+      return false;
+    cell[axis] += step[axis];
+    if (cell[axis] == out[axis])
+      return false;
+    next[axis] += delta[axis];
+  }
+}
+
+inline bool UniformGrid::hit(const Ray &r, double t_min, double t_max,
+                             HitRecord &rec) const {
+  // A primitive in several cells can be hit beyond the current one, so
+  // only hits before the cell's exit end the walk. Later hits are found
+  // again in the cell they are in.
+  bool hit_anything = false;
+  walk(r, t_min, t_max, [&](std::uint32_t first, std::uint32_t last,
+                            double exit) {
+    for (auto i = first; i < last; i++) {
+      if (prims[i]->hit(r, t_min, t_max, rec)) {
+        hit_anything = true;
+        t_max = rec.t;
+      }
+    }
+    return hit_anything && t_max <= exit;
+  });
+  return hit_anything;
+}
+
+inline bool UniformGrid::occluded(const Ray &r, double t_min,
+                                  double t_max) const {
+  return walk(r, t_min, t_max,
+              [&](std::uint32_t first, std::uint32_t last, double) {
+                for (auto i = first; i < last; i++) {
+                  if (prims[i]->occluded(r, t_min, t_max))
+                    return true;
+                }
+                return false;
+              });
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "rtweekend.h"
+#include "sampler.h"
 #include <cmath>
 #include <iostream>
 #include <ostream>
@@ -52,6 +53,17 @@ public:
                 random_double(min, max));
   }
 
+  inline static Vec3 random(Sampler &sampler) {
+    return Vec3(sampler.random_double(), sampler.random_double(),
+                sampler.random_double());
+  }
+
+  inline static Vec3 random(double min, double max, Sampler &sampler) {
+    return Vec3(sampler.random_double(min, max),
+                sampler.random_double(min, max),
+                sampler.random_double(min, max));
+  }
+
   inline bool near_zero() const {
     const auto s = 1e-8;
     return (std::abs(e[0]) < s) && (std::abs(e[1]) < s) && (std::abs(e[2]) < s);
@@ -99,20 +111,20 @@ inline Vec3 cross(const Vec3 &u, const Vec3 &v) {
 
 inline Vec3 unit_vector(const Vec3 &v) { return v / v.length(); }
 
-inline Vec3 random_in_unit_sphere() {
+inline Vec3 random_in_unit_sphere(Sampler &sampler) {
   while (true) {
-    auto p = Vec3::random(-1, 1);
+    auto p = Vec3::random(-1, 1, sampler);
     if (p.length_squared() < 1)
       return p;
   }
 }
 
-inline Vec3 random_unit_vector() {
-  return unit_vector(random_in_unit_sphere());
+inline Vec3 random_unit_vector(Sampler &sampler) {
+  return unit_vector(random_in_unit_sphere(sampler));
 }
 
-inline Vec3 random_in_hemisphere(const Vec3 &normal) {
-  Vec3 in_unit_sphere = random_in_unit_sphere();
+inline Vec3 random_in_hemisphere(const Vec3 &normal, Sampler &sampler) {
+  Vec3 in_unit_sphere = random_in_unit_sphere(sampler);
   if (dot(in_unit_sphere, normal) > 0.0) { // same hemisphere are normal
     return in_unit_sphere;
   } else {
@@ -120,9 +132,10 @@ inline Vec3 random_in_hemisphere(const Vec3 &normal) {
   }
 }
 
-inline Vec3 random_in_unit_disk() {
+inline Vec3 random_in_unit_disk(Sampler &sampler) {
   while (true) {
-    auto p = Vec3(random_double(-1, 1), random_double(-1, 1), 0);
+    auto p =
+        Vec3(sampler.random_double(-1, 1), sampler.random_double(-1, 1), 0);
     if (p.length_squared() < 1)
       return p;
   }
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "ray.h"
+#include "rtweekend.h"
+#include "sampler.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+/**
+ * A wavefront (queue based) path tracer.
+ *
+ * Instead of following one path from the camera to the end before starting
+ * the next, every path of a batch advances one bounce at a time in stages:
+ * intersect all active rays, bin the hits by material, shade each bin and
+ * queue the extension rays for the next round. Each stage is a tight loop
+ * over thousands of rays, so the same Hittable::hit or Material::scatter
+ * code runs back to back instead of alternating per ray.
+ *
+ * Paths consume their random numbers in the same order as ray_color, so
+ * both integrators compute the same estimate. The images are bit-identical
+ * when built without -ffast-math, which -Ofast otherwise lets the compiler
+ * apply differently to the two code paths.
+ */
+class Wavefront {
+public:
+  // Samples [first, last) of pixel (x, y)
+  struct Job {
+    unsigned x, y;
+    int first, last;
+  };
+
+  Wavefront(const Camera &cam, const Hittable &world, const Color &background,
+            unsigned image_width, unsigned image_height, int max_depth,
+            int roulette_depth)
+      : cam(cam), world(world), background(background),
+        image_width(image_width), image_height(image_height),
+        max_depth(max_depth), roulette_depth(roulette_depth) {}
+
+  // Traces every sample of every job. The radiance of each sample is written
+  // to out in job order. Returns the number of rays traced.
+  unsigned long long trace(const std::vector<Job> &jobs,
+                           std::vector<Color> &out) const;
+
+private:
+  // Path state in structure of arrays form, indexed by path
+  struct Paths {
+    std::vector<Ray> ray;
+    std::vector<Color> throughput;
+    std::vector<Color> radiance;
+    std::vector<Sampler> sampler;
+    std::vector<HitRecord> rec;
+  };
+
+  const Camera &cam;
+  const Hittable &world;
+  Color background;
+  unsigned image_width, image_height;
+  int max_depth;
+  int roulette_depth;
+};
+
+inline unsigned long long Wavefront::trace(const std::vector<Job> &jobs,
+                                           std::vector<Color> &out) const {
+  std::size_t count = 0;
+  for (const auto &job : jobs) {
+    count += job.last - job.first;
+  }
+
+  Paths paths;
+  paths.ray.reserve(count);
+  paths.sampler.reserve(count);
+  paths.throughput.assign(count, Color(1, 1, 1));
+  paths.radiance.assign(count, Color(0, 0, 0));
+  paths.rec.resize(count);
+
+  // Generate camera rays
+  for (const auto &job : jobs) {
+    const auto pixel = static_cast<std::uint64_t>(job.y) * image_width + job.x;
+    for (int s = job.first; s < job.last; s++) {
+      paths.sampler.emplace_back(pixel, s);
+      auto &sampler = paths.sampler.back();
+      auto u = (job.x + sampler.random_double()) / (image_width - 1);
+      auto v = (job.y + sampler.random_double()) / (image_height - 1);
+      paths.ray.push_back(cam.get_ray(u, v, sampler));
+    }
+  }
+
+  std::vector<std::uint32_t> active(count);
+  std::iota(active.begin(), active.end(), 0);
+  std::vector<std::uint32_t> hits;
+  std::vector<std::uint32_t> extended;
+  hits.reserve(count);
+  extended.reserve(count);
+
+  for (int depth = 0; depth < max_depth && !active.empty(); depth++) {
+    // Intersect
+    hits.clear();
+    for (auto i : active) {
+      paths.sampler[i].next_bounce();
+      if (world.hit(paths.ray[i], 0.001, inf, paths.rec[i])) {
+        hits.push_back(i);
+      } else {
+        paths.radiance[i] += paths.throughput[i] * background;
+      }
+    }
+
+    // Bin by material so each material's shading runs as one batch. Ties keep
+    // path order, which keeps memory access in the later loops sequential.
+    std::stable_sort(hits.begin(), hits.end(),
+                     [&](std::uint32_t a, std::uint32_t b) {
+                       return paths.rec[a].mat_ptr.get() <
+                              paths.rec[b].mat_ptr.get();
+                     });
+
+    // Shade and queue extension rays
+    extended.clear();
+    for (auto i : hits) {
+      const auto &rec = paths.rec[i];
+      auto &throughput = paths.throughput[i];
+      auto &sampler = paths.sampler[i];
+
+      Ray scattered;
+      Color attenuation;
+      paths.radiance[i] +=
+          throughput * rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+      if (!rec.mat_ptr->scatter(paths.ray[i], rec, attenuation, scattered,
+                                sampler)) {
+        continue;
+      }
+      throughput = throughput * attenuation;
+
+      if (depth >= roulette_depth) {
+        auto survive = std::min(
+            0.95, std::max({throughput.x(), throughput.y(), throughput.z()}));
+        if (sampler.random_double() >= survive) {
+          continue;
+        }
+        throughput /= survive;
+      }
+      paths.ray[i] = scattered;
+      extended.push_back(i);
+    }
+
+    // Keep path order for the next intersection stage
+    std::sort(extended.begin(), extended.end());
+    std::swap(active, extended);
+  }
+
+  unsigned long long rays = 0;
+  out.clear();
+  out.reserve(count);
+  for (std::size_t i = 0; i < count; i++) {
+    out.push_back(paths.radiance[i]);
+    rays += paths.sampler[i].bounces();
+  }
+  return rays;
+}
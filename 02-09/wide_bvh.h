@@ -0,0 +1,471 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "ray.h"
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+/**
+ * A node with up to N children whose boxes are stored as structure of arrays,
+ * bounds[0 for min, 1 for max][axis][child], so one SIMD slab test covers all
+ * of them. A child with count > 0 is a leaf of count primitives starting at
+ * child[i], otherwise child[i] is another node. Unused slots have an empty box
+ * and never hit.
+ */
+template <int N> struct alignas(64) WideBvhNode {
+  float bounds[2][3][N];
+  std::uint32_t child[N];
+  std::uint8_t count[N];
+};
+
+// A ray prepared for intersect_lanes
+struct RayLanes {
+  float org_near[3];
+  float org_far[3];
+  float inv[3];
+  int sign[3];
+};
+
+inline RayLanes ray_lanes(const Ray &r) {
+  RayLanes ray;
+  for (int a = 0; a < 3; a++) {
+    // Moving the origin by more than its rounding error towards the far
+    // side makes the near distance smaller, and towards the near side the
+    // far distance larger, than the exact ones. Done without branches, the
+    // ray signs are unpredictable.
+    const auto o = static_cast<float>(r.origin()[a]);
+    const auto error = std::abs(o) * std::numeric_limits<float>::epsilon() +
+                       std::numeric_limits<float>::min();
+    const float towards = 1 - 2 * r.getSign(a); // +1 or -1
+    ray.sign[a] = r.getSign(a);
+    ray.org_near[a] = o + towards * error;
+    ray.org_far[a] = o - towards * error;
+    ray.inv[a] = static_cast<float>(r.invDirection()[a]);
+  }
+  return ray;
+}
+
+// Bit i of the result is set when box i of bounds, [0 for min, 1 for
+// max][axis][box], is hit by ray between t_min and t_max. t_near[i] is its
+// entry distance.
+template <int N>
+int intersect_lanes(const float (&bounds)[2][3][N], const RayLanes &ray,
+                    float t_min, float t_max, float t_near[N]) {
+  // Widens the far distance to cover the rounding of the float arithmetic
+  const float far_scale = 1 + 4 * std::numeric_limits<float>::epsilon();
+
+  // The max/min operands are ordered so that a NaN from 0 * inf (a ray
+  // parallel to a slab starting on its plane) keeps the running value
+#if defined(__AVX__)
+  if constexpr (N == 8) {
+    auto lo = _mm256_set1_ps(t_min);
+    auto hi = _mm256_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+      // Indexed rather than branched on, the signs are unpredictable
+      const float *near = bounds[ray.sign[a]][a];
+      const float *far = bounds[1 - ray.sign[a]][a];
+      const auto inv = _mm256_set1_ps(ray.inv[a]);
+      const auto t0 = _mm256_mul_ps(
+          _mm256_sub_ps(_mm256_load_ps(near), _mm256_set1_ps(ray.org_near[a])),
+          inv);
+      const auto t1 = _mm256_mul_ps(
+          _mm256_sub_ps(_mm256_load_ps(far), _mm256_set1_ps(ray.org_far[a])),
+          inv);
+      lo = _mm256_max_ps(t0, lo);
+      hi = _mm256_min_ps(t1, hi);
+    }
+    hi = _mm256_mul_ps(hi, _mm256_set1_ps(far_scale));
+    _mm256_storeu_ps(t_near, lo);
+    return _mm256_movemask_ps(_mm256_cmp_ps(lo, hi, _CMP_LE_OQ));
+  }
+#endif
+#if defined(__SSE2__)
+  if constexpr (N == 4) {
+    auto lo = _mm_set1_ps(t_min);
+    auto hi = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+      const float *near = bounds[ray.sign[a]][a];
+      const float *far = bounds[1 - ray.sign[a]][a];
+      const auto inv = _mm_set1_ps(ray.inv[a]);
+      const auto t0 = _mm_mul_ps(
+          _mm_sub_ps(_mm_load_ps(near), _mm_set1_ps(ray.org_near[a])), inv);
+      const auto t1 = _mm_mul_ps(
+          _mm_sub_ps(_mm_load_ps(far), _mm_set1_ps(ray.org_far[a])), inv);
+      lo = _mm_max_ps(t0, lo);
+      hi = _mm_min_ps(t1, hi);
+    }
+    hi = _mm_mul_ps(hi, _mm_set1_ps(far_scale));
+    _mm_storeu_ps(t_near, lo);
+    return _mm_movemask_ps(_mm_cmple_ps(lo, hi));
+  }
+#endif
+
+  int mask = 0;
+  for (int i = 0; i < N; i++) {
+    float lo = t_min;
+    float hi = t_max;
+    for (int a = 0; a < 3; a++) {
+      const float near = bounds[ray.sign[a]][a][i];
+      const float far = bounds[1 - ray.sign[a]][a][i];
+      const float t0 = (near - ray.org_near[a]) * ray.inv[a];
+      const float t1 = (far - ray.org_far[a]) * ray.inv[a];
+      lo = t0 > lo ? t0 : lo;
+      hi = t1 < hi ? t1 : hi;
+    }
+    t_near[i] = lo;
+    mask |= (lo <= hi * far_scale) << i;
+  }
+  return mask;
+}
+
+/**
+ * An N wide BVH (N = 4 or 8) collapsed from a binary BvhBuild.
+ *
+ * Each wide node takes the children of a binary node and keeps opening the
+ * child with the largest surface area until it has N of them. The children's
+ * boxes are tested against the ray with SSE (N = 4) or AVX (N = 8) when the
+ * compiler targets them, and with a scalar loop otherwise. Hit children are
+ * pushed nearest on top and skipped when popped behind the closest hit.
+ *
+ * The slab test runs in single precision. The origin is moved away from the
+ * box on each side and the far distance is widened by a few ulps, so boxes
+ * are never missed because of the conversion.
+ *
+ * After collapsing, nodes are reordered into treelets: starting from a root,
+ * the children with the largest boxes, the ones rays most likely visit, are
+ * added until the treelet fills a page. Each treelet is contiguous, so a ray
+ * going down touches few pages and cache lines even when the tree is far
+ * larger than the caches. Nodes about to be visited are prefetched when they
+ * are pushed.
+ */
+template <int N> class WideBvh : public Hittable {
+  static_assert(N == 4 || N == 8, "WideBvh supports 4 or 8 children");
+
+public:
+  WideBvh(const HittableList &list, double time0, double time1,
+          const BvhBuildOptions &options)
+      : WideBvh(BvhBuilder(options).build(
+                    bvh_primitives(list.objects, time0, time1)),
+                list.objects) {}
+
+  WideBvh(const BvhBuild &build,
+          const std::vector<std::shared_ptr<Hittable>> &objects);
+
+  virtual bool hit(const Ray &r, double t_min, double t_max,
+                   HitRecord &rec) const override;
+
+  virtual bool occluded(const Ray &r, double t_min,
+                        double t_max) const override;
+
+  virtual bool bounding_box(double time0, double time1,
+                            Aabb &output_box) const override {
+    output_box = box;
+    return !nodes.empty();
+  }
+
+  const std::vector<WideBvhNode<N>> &node_array() const { return nodes; }
+
+private:
+  struct Entry {
+    std::uint32_t child;
+    std::uint32_t count; // 0 for nodes
+    float t;
+  };
+
+  // Binary build nodes can be at most max_bvh_depth deep, and every wide
+  // node on the way down leaves at most N - 1 siblings on the stack
+  static const int max_stack = max_bvh_depth * (N - 1) + 1;
+
+  std::uint32_t collapse(const BvhBuild &build, std::uint32_t node);
+
+  // Treelets are laid out to fill pages of this many bytes
+  static const std::size_t treelet_bytes = 4096;
+
+  void layout_treelets();
+
+  void prefetch(std::uint32_t node) const;
+
+  std::vector<WideBvhNode<N>> nodes;
+  std::vector<const Hittable *> prims;
+  std::vector<std::shared_ptr<Hittable>> owned; // keeps prims alive
+  Aabb box;
+};
+
+using Bvh4 = WideBvh<4>;
+using Bvh8 = WideBvh<8>;
+
+template <int N>
+WideBvh<N>::WideBvh(const BvhBuild &build,
+                    const std::vector<std::shared_ptr<Hittable>> &objects) {
+  owned.reserve(build.prims.size());
+  prims.reserve(build.prims.size());
+  for (const auto &prim : build.prims) {
+    owned.push_back(objects[prim.index]);
+    prims.push_back(owned.back().get());
+  }
+
+  if (build.nodes.empty())
+    return;
+  box = build.nodes[0].bounds;
+  collapse(build, 0);
+  layout_treelets();
+}
+
+template <int N>
+std::uint32_t WideBvh<N>::collapse(const BvhBuild &build, std::uint32_t node) {
+  // Gather up to N binary nodes below this one. A leaf root becomes the
+  // only child of the wide root.
+  std::uint32_t children[N];
+  int count = 0;
+  if (build.nodes[node].leaf()) {
+    children[count++] = node;
+  } else {
+    children[count++] = build.nodes[node].child[0];
+    children[count++] = build.nodes[node].child[1];
+  }
+  while (count < N) {
+    int largest = -1;
+    double largest_area = -1;
+    for (int i = 0; i < count; i++) {
+      const auto &n = build.nodes[children[i]];
+      if (!n.leaf() && n.bounds.surface_area() > largest_area) {
+        largest = i;
+        largest_area = n.bounds.surface_area();
+      }
+    }
+    if (largest < 0)
+      break;
+    const auto &open = build.nodes[children[largest]];
+    children[largest] = open.child[0];
+    children[count++] = open.child[1];
+  }
+
+  const auto index = static_cast<std::uint32_t>(nodes.size());
+  nodes.emplace_back();
+  for (int i = 0; i < N; i++) {
+    for (int a = 0; a < 3; a++) {
+      nodes[index].bounds[0][a][i] = std::numeric_limits<float>::infinity();
+      nodes[index].bounds[1][a][i] = -std::numeric_limits<float>::infinity();
+    }
+    nodes[index].child[i] = 0;
+    nodes[index].count[i] = 0;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const auto &n = build.nodes[children[i]];
+    // nodes may reallocate while collapsing the child
+    auto child = n.leaf() ? n.first : collapse(build, children[i]);
+    auto &out = nodes[index];
+    for (int a = 0; a < 3; a++) {
+      out.bounds[0][a][i] = round_down(n.bounds.min()[a]);
+      out.bounds[1][a][i] = round_up(n.bounds.max()[a]);
+    }
+    out.child[i] = child;
+    out.count[i] = n.leaf() ? static_cast<std::uint8_t>(n.count) : 0;
+  }
+  return index;
+}
+
+template <int N> void WideBvh<N>::layout_treelets() {
+  const auto treelet_size =
+      std::max<std::size_t>(1, treelet_bytes / sizeof(WideBvhNode<N>));
+
+  // Whether child i is another node. Unused slots point at the root, which
+  // is no node's child.
+  auto interior = [this](std::uint32_t node, int i) {
+    return nodes[node].count[i] == 0 && nodes[node].child[i] != 0;
+  };
+
+  // Surface area of the box of child i, 0 for unused slots and flat boxes.
+  // Only decides which nodes share a treelet.
+  auto area = [this](std::uint32_t node, int i) {
+    const auto &n = nodes[node];
+    const float dx = n.bounds[1][0][i] - n.bounds[0][0][i];
+    const float dy = n.bounds[1][1][i] - n.bounds[0][1][i];
+    const float dz = n.bounds[1][2][i] - n.bounds[0][2][i];
+    return dx < 0 || dy < 0 || dz < 0 ? 0.0f : dx * dy + dy * dz + dz * dx;
+  };
+
+  struct Candidate {
+    std::uint32_t node;
+    float area;
+  };
+  std::vector<std::uint32_t> order; // old index of every new position
+  order.reserve(nodes.size());
+  std::vector<std::uint32_t> roots{0};
+  std::vector<Candidate> frontier;
+
+  while (!roots.empty()) {
+    // Treelets are laid out depth first, so sibling treelets stay close
+    frontier.assign(1, {roots.back(), 0});
+    roots.pop_back();
+    for (std::size_t taken = 0; taken < treelet_size && !frontier.empty();
+         taken++) {
+      std::size_t best = 0;
+      for (std::size_t i = 1; i < frontier.size(); i++) {
+        if (frontier[i].area > frontier[best].area)
+          best = i;
+      }
+      const auto node = frontier[best].node;
+      frontier[best] = frontier.back();
+      frontier.pop_back();
+
+      order.push_back(node);
+      for (int i = 0; i < N; i++) {
+        if (interior(node, i))
+          frontier.push_back({nodes[node].child[i], area(node, i)});
+      }
+    }
+
+    // What did not fit starts new treelets, largest first
+    std::sort(frontier.begin(), frontier.end(),
+              [](const Candidate &a, const Candidate &b) {
+                return a.area < b.area;
+              });
+    for (const auto &candidate : frontier) {
+      roots.push_back(candidate.node);
+    }
+  }
+
+  std::vector<std::uint32_t> position(nodes.size());
+  for (std::size_t i = 0; i < order.size(); i++) {
+    position[order[i]] = static_cast<std::uint32_t>(i);
+  }
+  std::vector<WideBvhNode<N>> reordered(order.size());
+  for (std::size_t i = 0; i < order.size(); i++) {
+    reordered[i] = nodes[order[i]];
+    for (int c = 0; c < N; c++) {
+      if (interior(order[i], c))
+        reordered[i].child[c] = position[reordered[i].child[c]];
+    }
+  }
+  nodes = std::move(reordered);
+}
+
+template <int N> void WideBvh<N>::prefetch(std::uint32_t node) const {
+#if defined(__GNUC__)
+  const auto *p = reinterpret_cast<const char *>(&nodes[node]);
+  for (std::size_t line = 0; line < sizeof(WideBvhNode<N>); line += 64) {
+    __builtin_prefetch(p + line);
+  }
+#endif
+}
+
+// Index of the lowest set bit of a non zero mask
+inline int lowest_bit(unsigned mask) {
+#if defined(__GNUC__)
+  return __builtin_ctz(mask);
+#else
+  int i = 0;
+  while (!(mask & 1u << i))
+    i++;
+  return i;
+#endif
+}
+
+template <int N>
+bool WideBvh<N>::hit(const Ray &r, double t_min, double t_max,
+                     HitRecord &rec) const {
+  if (nodes.empty())
+    return false;
+
+  const auto ray = ray_lanes(r);
+  // The far_scale widening in intersect_lanes covers rounding t_max to float
+  const auto near_limit = round_down(t_min);
+  auto far_limit = static_cast<float>(t_max);
+  Entry stack[max_stack];
+  int top = 0;
+  stack[top++] = {0, 0, near_limit};
+  bool hit_anything = false;
+
+  while (top > 0) {
+    const auto entry = stack[--top];
+    if (entry.t > t_max)
+      continue;
+
+    if (entry.count > 0) {
+      for (auto i = entry.child; i < entry.child + entry.count; i++) {
+        if (prims[i]->hit(r, t_min, t_max, rec)) {
+          hit_anything = true;
+          t_max = rec.t;
+          far_limit = static_cast<float>(t_max);
+        }
+      }
+      continue;
+    }
+
+    const auto &node = nodes[entry.child];
+    alignas(32) float t_near[N];
+    auto mask =
+        intersect_lanes(node.bounds, ray, near_limit, far_limit, t_near);
+
+    // Push the hit children sorted by distance, nearest on top so it is
+    // popped first
+    const int bottom = top;
+    for (; mask != 0; mask &= mask - 1) {
+      const int i = lowest_bit(mask);
+      const Entry e{node.child[i], node.count[i], t_near[i]};
+      int j = top++;
+      for (; j > bottom && stack[j - 1].t < e.t; j--) {
+        stack[j] = stack[j - 1];
+      }
+      stack[j] = e;
+      if (e.count == 0)
+        prefetch(e.child);
+    }
+  }
+
+  return hit_anything;
+}
+
+template <int N>
+bool WideBvh<N>::occluded(const Ray &r, double t_min, double t_max) const {
+  if (nodes.empty())
+    return false;
+
+  // Any hit will do, so hit children are pushed unsorted and the far limit
+  // never shrinks
+  const auto ray = ray_lanes(r);
+  const auto near_limit = round_down(t_min);
+  const auto far_limit = static_cast<float>(t_max);
+  Entry stack[max_stack];
+  int top = 0;
+  stack[top++] = {0, 0, near_limit};
+
+  while (top > 0) {
+    const auto entry = stack[--top];
+    if (entry.count > 0) {
+      for (auto i = entry.child; i < entry.child + entry.count; i++) {
+        if (prims[i]->occluded(r, t_min, t_max))
+          return true;
+      }
+      continue;
+    }
+
+    const auto &node = nodes[entry.child];
+    alignas(32) float t_near[N];
+    for (auto mask =
+             intersect_lanes(node.bounds, ray, near_limit, far_limit, t_near);
+         mask != 0; mask &= mask - 1) {
+      const int i = lowest_bit(mask);
+      stack[top++] = {node.child[i], node.count[i], t_near[i]};
+      if (node.count[i] == 0)
+        prefetch(node.child[i]);
+    }
+  }
+  return false;
+}